@@ -0,0 +1,221 @@
+#ifndef BANTAM_BINARY_BOOK_H
+#define BANTAM_BINARY_BOOK_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "decimal_parser.h"
+#include "order_book.h"
+#include "order_book_decoder.h"
+
+namespace bantam
+{
+    // Binary order book frame, all integers little endian:
+    //   uint8   format version, binary_book_version
+    //   uint8   flags, bit 0 set for snapshots
+    //   int8    price exponent e, a price is its mantissa * 10^e
+    //   int8    volume exponent
+    //   uint8   channel name length, followed by the name
+    //   varint  sequence
+    //   svarint timestamp
+    //   varint  number of bid levels, followed by the levels
+    //   varint  number of ask levels, followed by the levels
+    // A level is the svarint difference of its price mantissa from the previous level of
+    // the same side (from 0 for the first one) and the varint volume mantissa, 0 removes
+    // the level. Levels in book order make the differences one or two bytes long.
+    // varint is LEB128, svarint is zigzag encoded LEB128.
+    // Channel ids are local to each client, so frames name their channel.
+    static const uint8_t binary_book_version = 1;
+
+    namespace detail
+    {
+        // Dividing by an exact power of ten rounds once, like parsing the decimal
+        inline double from_mantissa(int64_t mantissa, int exponent)
+        {
+            return exponent < 0 ? mantissa / power_of_ten(exponent) : mantissa * power_of_ten(exponent);
+        }
+        inline int64_t to_mantissa(double value, int exponent)
+        {
+            return std::llround(exponent < 0 ? value * power_of_ten(exponent) : value / power_of_ten(exponent));
+        }
+    }
+
+    // Builds binary order book frames, used by servers and test feeds
+    struct binary_book_encoder
+    {
+        // Exponents are the decimal precision of prices and volumes, -18 to 18
+        binary_book_encoder(int price_exponent = -8, int volume_exponent = -8)
+            : price_exponent(price_exponent)
+            , volume_exponent(volume_exponent)
+        {
+            if (std::abs(price_exponent) > 18 || std::abs(volume_exponent) > 18)
+                throw std::invalid_argument("Invalid binary book exponent");
+        }
+
+        // Encodes changes of both sides into out, replacing its content. Levels of each side
+        // keep their order.
+        void encode(
+            std::vector<char>& out,
+            boost::string_view channel,
+            uint64_t sequence,
+            int64_t timestamp,
+            bool snapshot,
+            const std::vector<order_book_change>& changes) const
+        {
+            if (channel.size() > 255)
+                throw std::invalid_argument("Channel name too long for a binary book frame");
+            out.clear();
+            out.push_back(static_cast<char>(binary_book_version));
+            out.push_back(snapshot ? 1 : 0);
+            out.push_back(static_cast<char>(price_exponent));
+            out.push_back(static_cast<char>(volume_exponent));
+            out.push_back(static_cast<char>(channel.size()));
+            out.insert(out.end(), channel.begin(), channel.end());
+            put_varint(out, sequence);
+            put_svarint(out, timestamp);
+            put_side(out, order_book_side::bid, changes);
+            put_side(out, order_book_side::ask, changes);
+        }
+    private:
+        void put_side(std::vector<char>& out, order_book_side side, const std::vector<order_book_change>& changes) const
+        {
+            uint64_t count = 0;
+            for (const auto& c : changes)
+                count += c.side == side;
+            put_varint(out, count);
+            int64_t previous = 0;
+            for (const auto& c : changes)
+            {
+                if (c.side != side)
+                    continue;
+                int64_t price = detail::to_mantissa(c.price, price_exponent);
+                int64_t volume = detail::to_mantissa(c.volume, volume_exponent);
+                if (volume < 0)
+                    throw std::invalid_argument("Negative volume in binary book frame");
+                put_svarint(out, price - previous);
+                put_varint(out, static_cast<uint64_t>(volume));
+                previous = price;
+            }
+        }
+        static void put_varint(std::vector<char>& out, uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                out.push_back(static_cast<char>(v | 0x80));
+                v >>= 7;
+            }
+            out.push_back(static_cast<char>(v));
+        }
+        static void put_svarint(std::vector<char>& out, int64_t v)
+        {put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));}
+
+        int price_exponent, volume_exponent;
+    };
+
+    // Applies binary order book frames to the sink of their channel
+    struct binary_book_decoder
+    {
+        // Find is called as find(const char* channel, size_t length) and returns the sink
+        // registered for the channel or nullptr. Returns false if the frame is not a binary
+        // book frame of a channel with a sink, throws if it is malformed.
+        template <typename Find>
+        bool decode(const char* data, size_t size, Find&& find, order_book_message& message)
+        {
+            reader r{reinterpret_cast<const uint8_t*>(data), reinterpret_cast<const uint8_t*>(data) + size};
+            if (size < 5 || r.byte() != binary_book_version)
+                return false;
+            uint8_t flags = r.byte();
+            int price_exponent = static_cast<int8_t>(r.byte());
+            int volume_exponent = static_cast<int8_t>(r.byte());
+            if (std::abs(price_exponent) > 18 || std::abs(volume_exponent) > 18)
+                throw std::runtime_error("Malformed binary book frame");
+            size_t length = r.byte();
+            const char* channel = reinterpret_cast<const char*>(r.skip(length));
+            order_book_sink* sink = find(channel, length);
+            if (!sink)
+                return false;
+
+            message.sequence = r.varint();
+            message.timestamp = r.svarint();
+            message.snapshot = flags & 1;
+            message.levels = 0;
+            if (message.snapshot)
+                sink->begin_snapshot();
+            try
+            {
+                for (order_book_side side : {order_book_side::bid, order_book_side::ask})
+                {
+                    uint64_t count = r.varint();
+                    int64_t price = 0;
+                    for (uint64_t i = 0; i < count; ++i)
+                    {
+                        price += r.svarint();
+                        uint64_t volume = r.varint();
+                        sink->update_level(
+                                    side,
+                                    detail::from_mantissa(price, price_exponent),
+                                    detail::from_mantissa(static_cast<int64_t>(volume), volume_exponent));
+                    }
+                    message.levels += count;
+                }
+            }
+            catch (...)
+            {
+                // The levels read so far replace the book, as they would if applied one by one
+                if (message.snapshot)
+                    sink->end_snapshot();
+                throw;
+            }
+            if (message.snapshot)
+                sink->end_snapshot();
+            return true;
+        }
+    private:
+        struct reader
+        {
+            const uint8_t* p;
+            const uint8_t* end;
+
+            uint8_t byte()
+            {
+                if (p == end)
+                    truncated();
+                return *p++;
+            }
+            const uint8_t* skip(size_t n)
+            {
+                if (static_cast<size_t>(end - p) < n)
+                    truncated();
+                const uint8_t* at = p;
+                p += n;
+                return at;
+            }
+            uint64_t varint()
+            {
+                uint64_t v = 0;
+                for (int shift = 0; shift < 64; shift += 7)
+                {
+                    uint8_t b = byte();
+                    v |= uint64_t(b & 0x7f) << shift;
+                    if (!(b & 0x80))
+                        return v;
+                }
+                throw std::runtime_error("Malformed binary book frame");
+            }
+            int64_t svarint()
+            {
+                uint64_t v = varint();
+                return static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1));
+            }
+            [[noreturn]] static void truncated()
+            {throw std::runtime_error("Truncated binary book frame");}
+        };
+    };
+
+}//bantam
+#endif // BANTAM_BINARY_BOOK_H
@@ -0,0 +1,90 @@
+#ifndef BANTAM_CHANNEL_TABLE_H
+#define BANTAM_CHANNEL_TABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/assert.hpp>
+#include <boost/utility/string_view.hpp>
+
+namespace bantam
+{
+    // Compact channel handle, channel ids are dense so they can index arrays
+    using channel_id = uint32_t;
+    static const channel_id invalid_channel_id = ~channel_id(0);
+
+    // Interns channel names into channel ids. Lookups are a single probe sequence of an
+    // open addressing hash table that is kept at most half full.
+    struct channel_table
+    {
+        channel_table()
+            : slots(16, invalid_channel_id)
+        {}
+
+        size_t size() const
+        {return names.size();}
+        const std::string& name(channel_id id) const
+        {
+            BOOST_ASSERT(id < names.size());
+            return names[id];
+        }
+
+        channel_id find(boost::string_view name) const
+        {
+            uint64_t h = hash(name);
+            for (size_t i = h & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1))
+            {
+                channel_id id = slots[i];
+                if (id == invalid_channel_id || (hashes[id] == h && names[id] == name))
+                    return id;
+            }
+        }
+        // Returns the id of name, adding it to the table if needed
+        channel_id intern(boost::string_view name)
+        {
+            channel_id id = find(name);
+            if (id != invalid_channel_id)
+                return id;
+            id = static_cast<channel_id>(names.size());
+            names.emplace_back(name.data(), name.size());
+            hashes.push_back(hash(name));
+            if (2 * names.size() > slots.size())
+                rehash(2 * slots.size());
+            else insert(id);
+            return id;
+        }
+    private:
+        // FNV-1a
+        static uint64_t hash(boost::string_view name)
+        {
+            uint64_t h = 14695981039346656037ull;
+            for (char c : name)
+            {
+                h ^= static_cast<unsigned char>(c);
+                h *= 1099511628211ull;
+            }
+            return h;
+        }
+        void insert(channel_id id)
+        {
+            size_t i = hashes[id] & (slots.size() - 1);
+            while (slots[i] != invalid_channel_id)
+                i = (i + 1) & (slots.size() - 1);
+            slots[i] = id;
+        }
+        void rehash(size_t n)
+        {
+            slots.assign(n, invalid_channel_id);
+            for (channel_id id = 0; id < names.size(); ++id)
+                insert(id);
+        }
+
+        // Names never move once added, so references to them stay valid
+        std::deque<std::string> names;
+        std::vector<uint64_t> hashes;
+        std::vector<channel_id> slots;
+    };
+
+}//bantam
+#endif // BANTAM_CHANNEL_TABLE_H
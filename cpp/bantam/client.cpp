@@ -1,37 +1,211 @@
 #include "client.h"
 
+#include <sstream>
+
 namespace bantam
 {
 
+const size_t client::timer_period_seconds;
+const size_t client::max_message_size;
+const size_t client::recovery_timeout_seconds;
+
+// Microseconds from the steady clock to the system clock
+static int64_t steady_to_system_us()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count()
+            - duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 client::client(asio::io_context &ioc, const std::string &host, const std::string &path, const std::string &port)
-    : resolver_(ioc)
-    , ws_(ioc)
-    , timer(ioc, boost::posix_time::seconds(timer_period_seconds))
+    : strand_(asio::make_strand(ioc))
+    , resolver_(strand_)
+    , ws_(make_stream())
+    , buffer_(new boost::beast::flat_buffer)
+    , timer(strand_, boost::posix_time::seconds(timer_period_seconds))
     , host(host)
     , path(path)
     , port(port)
+    , retry_timer(strand_)
+    , jitter(std::random_device()())
+    , standby_resolver(strand_)
+    , standby_ws(make_stream())
+    , standby_buffer(new boost::beast::flat_buffer)
 {
+    for (auto* buffer : {buffer_.get(), standby_buffer.get()})
+        buffer->reserve(max_message_size + 1);
+    clock_offset_us = steady_to_system_us();
 }
 
 void client::write(std::string &&msg)
 {
+    if (!strand_.running_in_this_thread())
+    {
+        auto self = shared_from_this();
+        return asio::post(strand_, [self, msg = std::move(msg)]() mutable {self->write(std::move(msg));});
+    }
     if (!is_connected())
         return;
-    write_queue.push_back(std::move(msg));
+    write_queue.push().assign(msg.begin(), msg.end());
     write_next();
 }
 
 void client::write(const rapidjson::Value &doc)
 {
-    using namespace rapidjson;
-    StringBuffer buffer;
-    Writer<StringBuffer> writer(buffer);
-    doc.Accept(writer);
-    write(std::string(buffer.GetString(), buffer.GetString() + buffer.GetLength()));
+    if (!strand_.running_in_this_thread())
+    {
+        // The document belongs to the caller, serialise it before leaving its thread
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> w(buffer);
+        doc.Accept(w);
+        return write(std::string(buffer.GetString(), buffer.GetSize()));
+    }
+    if (!is_connected())
+        return;
+    doc.Accept(start_message());
+    write_next();
+}
+
+void client::set_compression(const compression_options &options)
+{
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::set_compression, shared_from_this(), options));
+    compression = options;
+    server_compression = true;
+}
+
+void client::set_gap_recovery(gap_recovery mode, const resource_name_type &resource_name)
+{
+    if (mode == gap_recovery::resource && !resource_name)
+        throw client_error("Invalid argument value: resource_name");
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::set_gap_recovery, shared_from_this(), mode, resource_name));
+    recovery = mode;
+    snapshot_resource = resource_name;
+}
+
+void client::set_max_write_batch(size_t n)
+{
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::set_max_write_batch, shared_from_this(), n));
+    max_write_batch = std::max<size_t>(n, 1);
+}
+
+void client::set_stats_dump(std::chrono::seconds period, const client::stats_callback_type &callback)
+{
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::set_stats_dump, shared_from_this(), period, callback));
+    stats_dump_period = period;
+    stats_callback = callback;
+    last_stats_dump = std::chrono::steady_clock::now();
+}
+
+client_stats_snapshot client::get_stats_snapshot() const
+{
+    client_stats_snapshot stats;
+    double ns_per_tick = tick_rate.nanoseconds_per_tick();
+    channel_counters.for_each([&](channel_id id, const channel_stats& counters)
+    {
+        channel_stats_snapshot channel;
+        channel.messages = counters.messages.load(std::memory_order_relaxed);
+        if (!channel.messages)
+            return;
+        channel.channel = id;
+        channel.bytes = counters.bytes.load(std::memory_order_relaxed);
+        channel.parse_ns = static_cast<double>(counters.parse_ticks.load(std::memory_order_relaxed)) * ns_per_tick;
+        channel.callback_ns = static_cast<double>(counters.callback_ticks.load(std::memory_order_relaxed)) * ns_per_tick;
+        stats.channels.push_back(channel);
+    });
+    stats.feed_latency_us = feed_latency.snapshot();
+    stats.clock_skewed = clock_skewed.load(std::memory_order_relaxed);
+    stats.handling_ns = handling_time.snapshot(ns_per_tick);
+    stats.write_queue_depth = write_queue_depth.load(std::memory_order_relaxed);
+    stats.max_write_queue_depth = max_write_queue_depth.load(std::memory_order_relaxed);
+    stats.reconnects = get_reconnect_count();
+    stats.failovers = get_failover_count();
+    return stats;
+}
+
+void client::record_message(channel_id id, int64_t timestamp, uint64_t parsed)
+{
+    uint64_t done = tick_clock::now();
+    channel_stats& counters = channel_counters.at(id);
+    bump(counters.messages);
+    bump(counters.bytes, read_size);
+    bump(counters.parse_ticks, parsed - read_ticks);
+    bump(counters.callback_ticks, done - parsed);
+    handling_time.record(done - read_ticks);
+    if (timestamp <= 0)
+        return;
+    int64_t received_us = std::chrono::duration_cast<std::chrono::microseconds>(last_read_time.time_since_epoch()).count() + clock_offset_us;
+    int64_t latency = received_us - timestamp * 1000;
+    if (latency < 0)
+    {
+        bump(clock_skewed);
+        latency = 0;
+    }
+    feed_latency.record(static_cast<uint64_t>(latency));
+}
+
+void client::record_write_queue()
+{
+    uint64_t depth = write_queue.size();
+    write_queue_depth.store(depth, std::memory_order_relaxed);
+    if (depth > max_write_queue_depth.load(std::memory_order_relaxed))
+        max_write_queue_depth.store(depth, std::memory_order_relaxed);
+}
+
+void client::dump_stats()
+{
+    client_stats_snapshot stats = get_stats_snapshot();
+    if (stats_callback)
+    {
+        try
+        {stats_callback(stats);}
+        catch(std::exception& e)
+        {
+            std::cerr << session_name << " Stats callback - " << e.what() << std::endl;
+        }
+        return;
+    }
+    uint64_t messages = 0;
+    for (const auto& channel : stats.channels)
+        messages += channel.messages;
+    std::ostringstream out;
+    out << "Stats: " << messages << " messages on " << stats.channels.size() << " channels"
+        << ", feed latency us p50 " << stats.feed_latency_us.percentile(50)
+        << " p99 " << stats.feed_latency_us.percentile(99)
+        << " max " << stats.feed_latency_us.max()
+        << ", handling ns p50 " << stats.handling_ns.percentile(50)
+        << " p99 " << stats.handling_ns.percentile(99)
+        << " max " << stats.handling_ns.max()
+        << ", write queue " << stats.write_queue_depth << " (max " << stats.max_write_queue_depth << ")"
+        << ", reconnects " << stats.reconnects;
+    info(out.str());
+}
+
+void client::set_reconnect_options(const reconnect_options &options)
+{
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::set_reconnect_options, shared_from_this(), options));
+    reconnection = options;
+}
+
+traffic_stats client::get_traffic_stats() const
+{
+    traffic_stats stats;
+    stats.raw_bytes_in = raw_bytes_in.load(std::memory_order_relaxed);
+    stats.wire_bytes_in = wire_stats.read_bytes.load(std::memory_order_relaxed);
+    stats.raw_bytes_out = raw_bytes_out.load(std::memory_order_relaxed);
+    stats.wire_bytes_out = wire_stats.bytes.load(std::memory_order_relaxed);
+    stats.compressed = compression_active;
+    return stats;
 }
 
 void client::run(std::function<void()> _ready_callback)
 {
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::run, shared_from_this(), _ready_callback));
     ready_callback = _ready_callback;
     open();
     timer.expires_from_now(boost::posix_time::seconds(timer_period_seconds));
@@ -43,14 +217,33 @@ void client::run(std::function<void()> _ready_callback)
 
 void client::stop()
 {
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::stop, shared_from_this()));
     timer.cancel();
+    close();
 }
 
 void client::open()
 {
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::open, shared_from_this()));
     info("Opening connection");
-    last_read_time = std::chrono::system_clock::now();
-    buffer_.consume(buffer_.size());
+    uint64_t id = connection_id = ++next_connection_id;
+    state = connection_state::resolving;
+    handshake_completed = false;
+    last_read_time = std::chrono::steady_clock::now();
+    // Anything left of a previous connection is dropped, the new one starts with the hello
+    // on a new stream, a WebSocket stream that failed once cannot be opened again
+    ws_ = make_stream();
+    buffer_->consume(buffer_->size());
+    write_queue.clear();
+    record_write_queue();
+    reading_now = false;
+    writing_now = false;
+    write_batch = 0;
+    // Connect to the endpoints resolved last time without resolving them again
+    if (endpoints_fresh())
+        return start_connect(id);
     // Look up the domain name
     resolver_.async_resolve(
                 host,
@@ -58,113 +251,434 @@ void client::open()
                 std::bind(
                     &client::on_resolve,
                     shared_from_this(),
+                    id,
                     std::placeholders::_1,
                     std::placeholders::_2));
 }
 
 void client::close()
 {
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::close, shared_from_this()));
     info("Closing connection");
-    if (is_connected())
+    bool connected = is_connected();
+    state = connection_state::closed;
+    retry_timer.cancel();
+    handshake_completed = false;
+    // Completions of the closed connection are ignored from now on
+    connection_id = ++next_connection_id;
+    drop_standby(boost::system::error_code(), "close");
+    if (connected)
     {
+        ws_->next_layer().uncork();
         // Close the WebSocket connection
-        ws_.async_close(websocket::close_code::normal,
+        ws_->async_close(websocket::close_code::normal,
                         std::bind(
                             &client::on_close,
                             shared_from_this(),
                             std::placeholders::_1));
     }
+    else
+    {
+        boost::system::error_code ignored;
+        ws_->next_layer().next_layer().close(ignored);
+    }
     reading_now = false;
     writing_now = false;
+    write_batch = 0;
 }
 
 void client::reconnect()
 {
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::reconnect, shared_from_this()));
     info("Reconnecting");
-    close();
+    retry_timer.cancel();
+    bool was_ready = handshake_completed;
+    open();
+    reconnects.fetch_add(1, std::memory_order_relaxed);
+    if (was_ready)
+        handle_disconnected();
+}
+
+void client::retry(boost::system::error_code ec, const char *what)
+{
+    // Closed by the user, or a retry is already waiting
+    if (state == connection_state::closed || state == connection_state::waiting)
+        return;
+    fail(ec, what);
+    if (standby == standby_state::ready)
+        return promote_standby();
+    bool was_ready = handshake_completed;
+    handshake_completed = false;
+    connection_id = ++next_connection_id;
+    boost::system::error_code ignored;
+    ws_->next_layer().next_layer().close(ignored);
+    reading_now = false;
+    writing_now = false;
+    write_batch = 0;
+
+    std::chrono::milliseconds delay = next_backoff();
+    info("Reconnecting in " + std::to_string(delay.count()) + " ms");
+    state = connection_state::waiting;
+    retry_timer.expires_after(delay);
+    retry_timer.async_wait(std::bind(
+                               &client::on_retry_timer,
+                               shared_from_this(),
+                               std::placeholders::_1));
+    if (was_ready)
+    {
+        try
+        {handle_disconnected();}
+        catch(std::exception& e)
+        {
+            std::cerr << session_name << " Handle disconnected - " << e.what() << std::endl;
+        }
+    }
+}
+
+void client::on_retry_timer(const boost::system::error_code &ec)
+{
+    if (ec || state != connection_state::waiting)
+        return;
+    reconnects.fetch_add(1, std::memory_order_relaxed);
     open();
 }
 
+std::chrono::milliseconds client::next_backoff()
+{
+    // Doubles with every retry, then a random point in its upper half
+    int64_t initial = std::max<int64_t>(reconnection.initial_backoff.count(), 1);
+    int64_t delay = std::min<int64_t>(initial << std::min(retries, 30u), reconnection.max_backoff.count());
+    delay = std::max<int64_t>(delay, 1);
+    ++retries;
+    return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(delay - delay / 2, delay)(jitter));
+}
+
+void client::resubscribe()
+{
+    for (auto& subscription : subscriptions)
+    {
+        if (!subscription.callback && !subscription.sink)
+            continue;
+        // The book starts over from the snapshot sent for the new subscription
+        if (subscription.sequencer)
+            subscription.sequencer->reset();
+        write_subscribe(get_channel_name(subscription.id));
+    }
+}
+
+void client::resend_resource_reads()
+{
+    for (const auto& read : resource_reads)
+        write_get(read.first, read.second.path);
+}
+
+void client::connection_ready()
+{
+    // What the previous connection had going is sent again in one batch
+    bool restored = ever_ready && reconnection.resubscribe;
+    ever_ready = true;
+    if (restored)
+        resubscribe();
+    resend_resource_reads();
+    try
+    {
+        if (restored)
+            handle_reconnected();
+        else handle_connected();
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << session_name << " Handle connected - " << e.what() << std::endl;
+        retry(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "handle connected");
+    }
+}
+
+std::unique_ptr<client::stream_type> client::make_stream()
+{
+    std::unique_ptr<stream_type> ws(new stream_type(strand_, 64 * 1024, &wire_stats));
+    // Also bounds the size of inflated messages
+    ws->read_message_max(max_message_size);
+    return ws;
+}
+
+bool client::endpoints_fresh() const
+{
+    return !endpoints.empty() && std::chrono::steady_clock::now() - endpoints_resolved < reconnection.resolve_ttl;
+}
+
+void client::cache_endpoints(const tcp::resolver::results_type &results)
+{
+    endpoints = results;
+    endpoints_resolved = std::chrono::steady_clock::now();
+}
+
+websocket::permessage_deflate client::deflate_options() const
+{
+    websocket::permessage_deflate deflate;
+    deflate.client_enable = compression.enabled && server_compression;
+    deflate.client_max_window_bits = compression.client_max_window_bits;
+    deflate.server_max_window_bits = compression.server_max_window_bits;
+    deflate.client_no_context_takeover = compression.client_no_context_takeover;
+    deflate.server_no_context_takeover = compression.server_no_context_takeover;
+    deflate.compLevel = compression.compression_level;
+    deflate.memLevel = compression.memory_level;
+    return deflate;
+}
+
 void client::get_resource(const std::string &path, const client::json_callback_type &callback)
 {
     if (!callback)
         throw client_error("Invalid argument value: callback");
+    if (!strand_.running_in_this_thread())
+        return asio::post(strand_, std::bind(&client::get_resource, shared_from_this(), path, callback));
 
     int64_t id = next_opaque();
-    resource_reads[id] = callback;
+    resource_reads[id] = resource_read{path, callback};
+    // Otherwise sent once the connection is ready
+    write_get(id, path);
+}
 
-    using namespace rapidjson;
-    Document doc(kObjectType);
-    doc.AddMember("type", Value("get").Move(), doc.GetAllocator());
-    doc.AddMember("resource", Value(StringRef(path)).Move(), doc.GetAllocator());
-    doc.AddMember("opaque", Value(id).Move(), doc.GetAllocator());
-    write(doc);
+channel_id client::subscribe(const std::string &channel_name, const client::json_callback_type &callback)
+{
+    return subscribe(channel_name, [callback](channel_id, const rapidjson::Value& val){callback(val);});
 }
 
-void client::subscribe(const std::string &channel_name, const client::json_callback_type &callback)
+channel_id client::subscribe(const std::string &channel_name, const client::data_callback_type &callback)
 {
     if (!handshake_completed)
         throw client_error("Connection is not ready");
 
-    subscriptions.emplace(channel_name, callback);
-    using namespace rapidjson;
-    Document doc(kObjectType);
-    doc.AddMember("type", Value("subscribe").Move(), doc.GetAllocator());
-    doc.AddMember("channel", Value(StringRef(channel_name)).Move(), doc.GetAllocator());
-    doc.AddMember("opaque", Value(next_opaque()).Move(), doc.GetAllocator());
-    write(doc);
+    channel_id id = intern_channel(channel_name);
+    if (!strand_.running_in_this_thread())
+        asio::post(strand_, std::bind(&client::add_subscription, shared_from_this(), id, channel_name, callback));
+    else add_subscription(id, channel_name, callback);
+    return id;
+}
+
+channel_id client::subscribe_order_book(const std::string &channel_name, order_book_queue &queue)
+{
+    auto sink = std::make_shared<queued_order_book_sink>(queue);
+    return subscribe_sink(channel_name, sink, [sink](const order_book_message& message){sink->commit(message);});
+}
+
+channel_id client::subscribe_sink(const std::string &channel_name, const std::shared_ptr<order_book_sink> &sink, const client::book_callback_type &callback)
+{
+    if (!handshake_completed)
+        throw client_error("Connection is not ready");
+    if (!sink)
+        throw client_error("Invalid argument value: sink");
+
+    channel_id id = intern_channel(channel_name);
+    if (!strand_.running_in_this_thread())
+        asio::post(strand_, std::bind(&client::add_book_subscription, shared_from_this(), id, channel_name, sink, callback));
+    else add_book_subscription(id, channel_name, sink, callback);
+    return id;
+}
+
+channel_id client::intern_channel(const std::string &channel_name)
+{
+    std::lock_guard<std::mutex> lock(channels_mutex);
+    return channels.intern(channel_name);
+}
+
+channel_id client::find_channel(boost::string_view channel_name) const
+{
+    return strand_channels.find(channel_name);
+}
+
+void client::sync_channels()
+{
+    std::lock_guard<std::mutex> lock(channels_mutex);
+    for (channel_id id = static_cast<channel_id>(strand_channels.size()); id < channels.size(); ++id)
+        strand_channels.intern(channels.name(id));
+}
+
+client::channel_subscription &client::get_subscription(channel_id id)
+{
+    if (id >= strand_channels.size())
+        sync_channels();
+    if (id >= subscriptions.size())
+        subscriptions.resize(id + 1);
+    subscriptions[id].id = id;
+    return subscriptions[id];
+}
+
+void client::add_subscription(channel_id id, const std::string &channel_name, const client::data_callback_type &callback)
+{
+    get_subscription(id).callback = callback;
+    write_subscribe(channel_name);
+}
+
+void client::add_book_subscription(channel_id id, const std::string &channel_name, const std::shared_ptr<order_book_sink> &sink, const client::book_callback_type &callback)
+{
+    channel_subscription& subscription = get_subscription(id);
+    if (!subscription.sink)
+        ++book_subscriptions;
+    subscription.sink = sink;
+    subscription.book_callback = callback;
+    if (subscription.sequencer)
+        subscription.sequencer->reset();
+    else subscription.sequencer.reset(new order_book_sequencer(sequence_counters));
+    write_subscribe(channel_name);
+}
+
+void client::request_snapshot(client::channel_subscription &subscription)
+{
+    subscription.sequencer->recover();
+    sequence_counters.snapshot_requests.fetch_add(1, std::memory_order_relaxed);
+    const std::string& channel_name = get_channel_name(subscription.id);
+    info("Sequence gap on " + channel_name + ", requesting a snapshot");
+    if (recovery == gap_recovery::resource)
+    {
+        channel_id id = subscription.id;
+        return get_resource(snapshot_resource(channel_name), [this, id](const rapidjson::Value& content)
+        {on_snapshot_resource(id, content);});
+    }
+    write_unsubscribe(channel_name);
+    write_subscribe(channel_name);
+}
+
+void client::on_snapshot_resource(channel_id id, const rapidjson::Value &content)
+{
+    if (id >= subscriptions.size() || !subscriptions[id].sequencer || !subscriptions[id].sequencer->recovering())
+        return;
+    channel_subscription& subscription = subscriptions[id];
+    if (!content.IsObject())
+        throw client_error("Invalid order book snapshot resource");
+    // The content may also be a whole data message
+    auto data = content.FindMember("data");
+    const rapidjson::Value& book = data != content.MemberEnd() && data->value.IsObject() ? data->value : content;
+
+    order_book_message message;
+    message.channel = id;
+    message.snapshot = true;
+    auto sequence = content.FindMember("sequence");
+    if (sequence != content.MemberEnd() && sequence->value.IsUint64())
+        message.sequence = sequence->value.GetUint64();
+    auto timestamp = content.FindMember("timestamp");
+    if (timestamp != content.MemberEnd() && timestamp->value.IsInt64())
+        message.timestamp = timestamp->value.GetInt64();
+
+    order_book_sink* sink = subscription.sequencer->route(subscription.sink.get());
+    for (auto side : {order_book_side::bid, order_book_side::ask})
+    {
+        auto levels = book.FindMember(side == order_book_side::bid ? "bids" : "asks");
+        if (levels == book.MemberEnd() || !levels->value.IsArray())
+            continue;
+        for (const auto& level : levels->value.GetArray())
+        {
+            if (!level.IsArray() || level.Size() < 2 || !level[0].IsNumber() || !level[1].IsNumber())
+                throw client_error("Invalid order book snapshot resource");
+            sink->update_level(side, level[0].GetDouble(), level[1].GetDouble());
+            ++message.levels;
+        }
+    }
+    if (subscription.sequencer->record(message))
+        replay(subscription);
 }
 
-void client::on_resolve(boost::system::error_code ec, tcp::resolver::results_type results)
+void client::replay(client::channel_subscription &subscription)
 {
+    info("Order book " + get_channel_name(subscription.id) + " resynchronised");
+    bool recovered = subscription.sequencer->replay(*subscription.sink, [&](const order_book_message& message)
+    {
+        if (subscription.book_callback)
+            subscription.book_callback(message);
+    });
+    if (!recovered)
+        request_snapshot(subscription);
+}
+
+void client::on_resolve(uint64_t id, boost::system::error_code ec, tcp::resolver::results_type results)
+{
+    if (id != connection_id)
+        return;
     if(ec)
-        return fail(ec, "resolve");
+        return retry(ec, "resolve");
     info("Resolve");
+    cache_endpoints(results);
+    start_connect(id);
+}
+
+void client::start_connect(uint64_t id)
+{
+    state = connection_state::connecting;
 
     // Make the connection on the IP address we get from a lookup
     boost::asio::async_connect(
-                ws_.next_layer(),
-                results.begin(),
-                results.end(),
+                ws_->next_layer().next_layer(),
+                endpoints.begin(),
+                endpoints.end(),
                 std::bind(
                     &client::on_connect,
                     shared_from_this(),
+                    id,
                     std::placeholders::_1));
 }
 
-void client::on_connect(boost::system::error_code ec)
+void client::on_connect(uint64_t id, boost::system::error_code ec)
 {
+    if (id != connection_id)
+        return;
     if(ec)
-        return fail(ec, "connect");
+    {
+        // The cached endpoints may be stale, look them up again next time
+        endpoints = tcp::resolver::results_type();
+        return retry(ec, "connect");
+    }
     info("Connect");
+    state = connection_state::handshaking;
+    // Frames are coalesced by the write combining layer, so Nagle's delay only adds latency
+    ws_->next_layer().next_layer().set_option(tcp::no_delay(true), ec);
+
+    ws_->set_option(deflate_options());
 
     // Perform the websocket handshake
-    ws_.async_handshake(host, path,
+    handshake_response = websocket::response_type();
+    ws_->async_handshake(handshake_response, host, path,
                         std::bind(
                             &client::on_handshake,
                             shared_from_this(),
+                            id,
                             std::placeholders::_1));
 }
 
-void client::on_handshake(boost::system::error_code ec)
+void client::on_handshake(uint64_t id, boost::system::error_code ec)
 {
+    if (id != connection_id)
+        return;
     if(ec)
-        return fail(ec, "handshake");
+        return retry(ec, "handshake");
     info("Handhsake");
+    state = connection_state::opening;
+    compression_active = handshake_response[beast::http::field::sec_websocket_extensions].find("permessage-deflate") != boost::string_view::npos;
+    if (compression_active)
+        info("Compression enabled");
 
     do_read();
 }
 
-void client::on_write(boost::system::error_code ec, size_t bytes_transferred)
+void client::on_write(uint64_t id, boost::system::error_code ec, size_t bytes_transferred)
 {
     boost::ignore_unused(bytes_transferred);
 
+    if (id != connection_id)
+        return;
     if(ec)
-        return fail(ec, "write");
+        return retry(ec, "write");
+    raw_bytes_out.fetch_add(bytes_transferred, std::memory_order_relaxed);
     BOOST_VERIFY(writing_now);
     BOOST_VERIFY(!write_queue.empty());
     writing_now = false;
     write_queue.pop_front();
+    record_write_queue();
+    if (++write_batch >= max_write_batch || write_queue.empty())
+    {
+        write_batch = 0;
+        ws_->next_layer().uncork();
+    }
     if (!write_queue.empty())
         write_next();
 
@@ -173,82 +687,187 @@ void client::on_write(boost::system::error_code ec, size_t bytes_transferred)
     catch(std::exception& e)
     {
         std::cerr << session_name << " Handle write - " << e.what() << std::endl;
-        close();
+        retry(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "handle write");
     }
 }
 
-void client::on_read(boost::system::error_code ec, size_t bytes_transferred)
+void client::on_read(uint64_t id, boost::system::error_code ec, size_t bytes_transferred)
 {
     using namespace rapidjson;
 
     boost::ignore_unused(bytes_transferred);
 
+    if (id == standby_id && standby != standby_state::none)
+        return on_standby_read(ec, bytes_transferred);
+    if (id != connection_id)
+        return;
     reading_now = false;
 
     if(ec)
-        return fail(ec, "read");
+        return retry(ec, "read");
 
-    last_read_time = std::chrono::system_clock::now();
-    std::string str = boost::beast::buffers_to_string(buffer_.data());
-    buffer_.consume(buffer_.size());
+    last_read_time = std::chrono::steady_clock::now();
+    read_ticks = tick_clock::now();
+    read_size = bytes_transferred;
+    raw_bytes_in.fetch_add(bytes_transferred, std::memory_order_relaxed);
+    // A failover while handling the message swaps buffer_ for the standby one
+    boost::beast::flat_buffer& buffer = *buffer_;
     try
     {
-        if (ws_.got_text())
+        if (ws_->got_text())
+        {
+            // Parse the frame in place, the terminating zero goes into the buffer's spare capacity
+            *static_cast<char*>(buffer.prepare(1).data()) = 0;
+            char* str = static_cast<char*>(buffer.data().data());
+            if (!book_subscriptions || !handle_order_book(str, buffer.size(), false))
+                handle_text(str);
+        }
+        else if (ws_->got_binary())
         {
-            using namespace rapidjson;
-            Document doc;
-            doc.Parse(str);
-            if (!doc.HasMember("type"))
-                throw client_error("Sequence failed, invalid message format");
-            std::string type = doc["type"].GetString();
-            int64_t opaque_id = doc.HasMember("opaque") ? doc["opaque"].GetInt64() : -1;
-            if (type == "hello")
-            {
-                if (handshake_completed)
-                    throw client_error("Connection sequence error, handshake already completed");
-                handshake_completed = true;
-                write_hello(opaque_id);
-                try
-                {handle_connected();}
-                catch(std::exception& e)
-                {
-                    std::cerr << session_name << " Handle connected - " << e.what() << std::endl;
-                    close();
-                }
-            }
-            else if (type == "ping")
-            {
-                write_pong(opaque_id);
-            }
-            else if (type == "get")
-            {
-                auto it = resource_reads.find(opaque_id);
-                if (it == resource_reads.end())
-                    throw client_error("Invalid resource read opaque id: " + std::to_string(opaque_id));
-
-                it->second(doc["content"]);
-            }
-            else if (type == "data")
-            {
-                const std::string& channel = doc["channel"].GetString();
-                auto it = subscriptions.find(channel);
-                if (it != subscriptions.end())
-                    it->second(doc);
-            }
+            const char* data = static_cast<const char*>(buffer.data().data());
+            if (!book_subscriptions || !handle_order_book(data, buffer.size(), true))
+                handle_read_binary(std::string(data, buffer.size()));
         }
-        else if (ws_.got_binary())
-            handle_read_binary(str);
     }
     catch(std::exception& e)
     {
         std::cerr << session_name << " Handle read - " << e.what() << std::endl;
-        close();
+        retry(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "handle read");
     }
+    buffer.consume(buffer.size());
+    parse_arena.reset();
+    // The connection failed while handling the message
+    if (id != connection_id)
+        return;
 
     do_read();
     write_next();
 }
 
+void client::handle_text(char *str)
+{
+    using namespace rapidjson;
+
+    auto doc = parse_arena.document();
+    doc.ParseInsitu(str);
+    uint64_t parsed = tick_clock::now();
+    if (!doc.IsObject())
+        throw client_error("Sequence failed, invalid message format");
+    auto type_it = doc.FindMember("type");
+    if (type_it == doc.MemberEnd())
+        throw client_error("Sequence failed, invalid message format");
+    auto opaque_it = doc.FindMember("opaque");
+    int64_t opaque_id = opaque_it != doc.MemberEnd() ? opaque_it->value.GetInt64() : -1;
+    switch (to_message_type(type_it->value.GetString(), type_it->value.GetStringLength()))
+    {
+    case message_type::hello:
+    {
+        if (handshake_completed)
+            throw client_error("Connection sequence error, handshake already completed");
+        handshake_completed = true;
+        state = connection_state::ready;
+        retries = 0;
+        check_compression(doc);
+        write_hello(opaque_id);
+        connection_ready();
+        break;
+    }
+    case message_type::ping:
+        write_pong(opaque_id);
+        break;
+    case message_type::get:
+    {
+        auto it = resource_reads.find(opaque_id);
+        if (it == resource_reads.end())
+            throw client_error("Invalid resource read opaque id: " + std::to_string(opaque_id));
+
+        json_callback_type callback = std::move(it->second.callback);
+        resource_reads.erase(it);
+        callback(doc["content"]);
+        break;
+    }
+    case message_type::data:
+    {
+        const Value& channel = doc["channel"];
+        channel_id id = find_channel(boost::string_view(channel.GetString(), channel.GetStringLength()));
+        if (id < subscriptions.size() && subscriptions[id].callback)
+        {
+            subscriptions[id].callback(id, doc);
+            auto timestamp = doc.FindMember("timestamp");
+            record_message(id, timestamp != doc.MemberEnd() && timestamp->value.IsInt64() ? timestamp->value.GetInt64() : 0, parsed);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void client::check_compression(const rapidjson::Value &hello)
+{
+    auto it = hello.FindMember("compression");
+    if (it == hello.MemberEnd())
+        return;
+    const rapidjson::Value& value = it->value;
+    if (value.IsBool())
+        server_compression = value.GetBool();
+    else if (value.IsString())
+    {
+        boost::string_view s(value.GetString(), value.GetStringLength());
+        server_compression = !(s.empty() || s == "false" || s == "none");
+    }
+    if (compression.enabled && !server_compression)
+        info("Server does not support compression, it will not be offered again");
+}
+
+client::channel_subscription *client::find_book_subscription(const char *channel, size_t length)
+{
+    // Channels whose subscription has not reached the strand yet are not found
+    channel_id id = find_channel(boost::string_view(channel, length));
+    if (id >= subscriptions.size() || !subscriptions[id].sink)
+        return nullptr;
+    return &subscriptions[id];
+}
+
+template <typename Decode>
+bool client::apply_order_book(Decode &&decode)
+{
+    channel_subscription* subscription = nullptr;
+    auto find = [&](const char* channel, size_t length) -> order_book_sink*
+    {
+        subscription = find_book_subscription(channel, length);
+        // Recovering channels record their messages instead of applying them
+        return subscription ? subscription->sequencer->route(subscription->sink.get()) : nullptr;
+    };
+    order_book_message message;
+    if (!decode(find, message))
+        return false;
+    uint64_t parsed = tick_clock::now();
+    message.channel = subscription->id;
+    order_book_sequencer& sequencer = *subscription->sequencer;
+    if (sequencer.recovering())
+    {
+        if (sequencer.record(message))
+            replay(*subscription);
+    }
+    // The book took the message already, a snapshot will replace whatever it broke
+    else if (!sequencer.check(message, recovery == gap_recovery::none) && recovery != gap_recovery::none)
+        request_snapshot(*subscription);
+    else if (subscription->book_callback)
+        subscription->book_callback(message);
+    record_message(message.channel, message.timestamp, parsed);
+    return true;
+}
+
+bool client::handle_order_book(const char *data, size_t size, bool binary)
+{
+    if (binary)
+        return apply_order_book([&](auto& find, order_book_message& message)
+        {return binary_decoder.decode(data, size, find, message);});
+    return apply_order_book([&](auto& find, order_book_message& message)
+    {return book_decoder.decode(data, size, find, message);});
+}
+
 void client::on_close(boost::system::error_code ec)
 {
     if(ec)
@@ -266,32 +885,64 @@ void client::on_close(boost::system::error_code ec)
 
 int64_t client::last_read_elapsed() const
 {
-    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_read_time).count();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_read_time).count();
 }
 
 void client::write_next()
 {
+    record_write_queue();
     if (writing_now || write_queue.empty() || !is_connected())
         return;
 
     writing_now = true;
+    // Hold the frames back while more messages are queued, so a batch goes out in one socket write
+    if (write_queue.size() > 1)
+        ws_->next_layer().cork();
     // Send the message
-    ws_.async_write(
+    ws_->async_write(
                 boost::asio::buffer(write_queue.front()),
                 std::bind(
                     &client::on_write,
                     shared_from_this(),
+                    connection_id,
                     std::placeholders::_1,
                     std::placeholders::_2));
 }
 
 void client::on_timer(const boost::system::error_code &ec)
 {
-    if (last_read_elapsed() >= reconnect_seconds)
-        reconnect();
+    if (state == connection_state::ready && reconnection.standby)
+    {
+        if (standby == standby_state::ready && last_read_elapsed() >= reconnection.failover_timeout.count())
+        {
+            info("Nothing read for " + std::to_string(last_read_elapsed()) + " ms, failing over");
+            promote_standby();
+        }
+        else open_standby();
+    }
+    else if (!reconnection.standby)
+        drop_standby(boost::system::error_code(), "standby disabled");
+
+    // Nothing arrived for too long, or the connection attempt hangs
+    if (state != connection_state::closed && state != connection_state::waiting
+            && last_read_elapsed() >= reconnection.idle_timeout.count())
+        retry(asio::error::timed_out, "idle");
 
     if (!ec)
     {
+        // Follow adjustments of the system clock
+        clock_offset_us = steady_to_system_us();
+        if (stats_dump_period.count() > 0 && std::chrono::steady_clock::now() - last_stats_dump >= stats_dump_period)
+        {
+            last_stats_dump = std::chrono::steady_clock::now();
+            dump_stats();
+        }
+        // Ask again for snapshots that did not arrive
+        auto now = order_book_sequencer::clock::now();
+        for (auto& subscription : subscriptions)
+            if (subscription.sequencer && subscription.sequencer->recovering()
+                    && now - subscription.sequencer->recovery_started() >= std::chrono::seconds(recovery_timeout_seconds))
+                request_snapshot(subscription);
 //        timer.expires_at(boost::posix_time::second_clock::universal_time() + boost::posix_time::seconds(timer_period_seconds));
         timer.expires_from_now(boost::posix_time::seconds(timer_period_seconds));
         timer.async_wait(std::bind(
@@ -308,34 +959,367 @@ void client::do_read()
         return;
     reading_now = true;
     // Read a message into our buffer
-    ws_.async_read(
-                buffer_,
+    ws_->async_read(
+                *buffer_,
                 std::bind(
                     &client::on_read,
                     shared_from_this(),
+                    connection_id,
                     std::placeholders::_1,
                     std::placeholders::_2));
 }
 
-void client::write_hello(int64_t opaque)
+void client::open_standby()
 {
-    using namespace rapidjson;
-    Document doc(kObjectType);
-    doc.AddMember("type", Value(StringRef("hello")).Move(), doc.GetAllocator());
-    doc.AddMember("opaque", Value(opaque).Move(), doc.GetAllocator());
-    doc.AddMember("protocol_version", Value(StringRef("1.0")).Move(), doc.GetAllocator());
+    // A write of the previous standby has not completed yet
+    if (standby != standby_state::none || !standby_queue.empty())
+        return;
+    info("Opening standby connection");
+    uint64_t id = standby_id = ++next_connection_id;
+    standby = standby_state::connecting;
+    standby_ws = make_stream();
+    standby_buffer->consume(standby_buffer->size());
+    if (endpoints_fresh())
+        return start_standby_connect(id);
+    standby_resolver.async_resolve(
+                host,
+                port,
+                std::bind(
+                    &client::on_standby_resolve,
+                    shared_from_this(),
+                    id,
+                    std::placeholders::_1,
+                    std::placeholders::_2));
+}
+
+void client::on_standby_resolve(uint64_t id, boost::system::error_code ec, tcp::resolver::results_type results)
+{
+    if (id != standby_id)
+        return;
+    if (ec)
+        return drop_standby(ec, "standby resolve");
+    cache_endpoints(results);
+    start_standby_connect(id);
+}
+
+void client::start_standby_connect(uint64_t id)
+{
+    boost::asio::async_connect(
+                standby_ws->next_layer().next_layer(),
+                endpoints.begin(),
+                endpoints.end(),
+                std::bind(
+                    &client::on_standby_connect,
+                    shared_from_this(),
+                    id,
+                    std::placeholders::_1));
+}
 
-    write(doc);
+void client::on_standby_connect(uint64_t id, boost::system::error_code ec)
+{
+    if (id != standby_id)
+        return;
+    if (ec)
+    {
+        endpoints = tcp::resolver::results_type();
+        return drop_standby(ec, "standby connect");
+    }
+    standby_ws->next_layer().next_layer().set_option(tcp::no_delay(true), ec);
+    standby_ws->set_option(deflate_options());
+    standby_response = websocket::response_type();
+    standby_ws->async_handshake(standby_response, host, path,
+                                std::bind(
+                                    &client::on_standby_handshake,
+                                    shared_from_this(),
+                                    id,
+                                    std::placeholders::_1));
+}
+
+void client::on_standby_handshake(uint64_t id, boost::system::error_code ec)
+{
+    if (id != standby_id)
+        return;
+    if (ec)
+        return drop_standby(ec, "standby handshake");
+    standby = standby_state::opening;
+    do_standby_read();
+}
+
+void client::do_standby_read()
+{
+    standby_reading = true;
+    standby_ws->async_read(
+                *standby_buffer,
+                std::bind(
+                    &client::on_read,
+                    shared_from_this(),
+                    standby_id,
+                    std::placeholders::_1,
+                    std::placeholders::_2));
+}
+
+void client::on_standby_read(boost::system::error_code ec, size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    standby_reading = false;
+    if (ec)
+        return drop_standby(ec, "standby read");
+    try
+    {
+        if (standby_ws->got_text())
+        {
+            *static_cast<char*>(standby_buffer->prepare(1).data()) = 0;
+            handle_standby_text(static_cast<char*>(standby_buffer->data().data()));
+        }
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << session_name << " Handle standby read - " << e.what() << std::endl;
+        parse_arena.reset();
+        return drop_standby(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "standby read");
+    }
+    standby_buffer->consume(standby_buffer->size());
+    parse_arena.reset();
+    do_standby_read();
+    // The connection failed while the standby was opening
+    if (standby == standby_state::ready && state != connection_state::ready)
+        promote_standby();
+}
+
+void client::handle_standby_text(char *str)
+{
+    auto doc = parse_arena.document();
+    doc.ParseInsitu(str);
+    if (!doc.IsObject())
+        throw client_error("Sequence failed, invalid message format");
+    auto type_it = doc.FindMember("type");
+    if (type_it == doc.MemberEnd())
+        throw client_error("Sequence failed, invalid message format");
+    auto opaque_it = doc.FindMember("opaque");
+    int64_t opaque_id = opaque_it != doc.MemberEnd() ? opaque_it->value.GetInt64() : -1;
+    switch (to_message_type(type_it->value.GetString(), type_it->value.GetStringLength()))
+    {
+    case message_type::hello:
+        if (standby != standby_state::opening)
+            throw client_error("Connection sequence error, handshake already completed");
+        write_standby(opaque_id, "hello");
+        standby = standby_state::ready;
+        info("Standby connection ready");
+        break;
+    case message_type::ping:
+        write_standby(opaque_id, "pong");
+        break;
+    default:
+        break;
+    }
+}
+
+void client::write_standby(int64_t opaque, const char *type)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> w(buffer);
+    w.StartObject();
+    w.Key("type");
+    w.String(type);
+    w.Key("opaque");
+    w.Int64(opaque);
+    if (standby == standby_state::opening)
+    {
+        w.Key("protocol_version");
+        w.String("1.0");
+    }
+    w.EndObject();
+    standby_queue.emplace_back(buffer.GetString(), buffer.GetSize());
+    write_standby_next();
+}
+
+void client::write_standby_next()
+{
+    if (standby_writing || standby_queue.empty())
+        return;
+    standby_writing = true;
+    standby_ws->async_write(
+                boost::asio::buffer(standby_queue.front()),
+                std::bind(
+                    &client::on_standby_write,
+                    shared_from_this(),
+                    standby_id,
+                    std::placeholders::_1,
+                    std::placeholders::_2));
+}
+
+void client::on_standby_write(uint64_t id, boost::system::error_code ec, size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (id != standby_id)
+    {
+        // The standby was dropped, or promoted in which case the connection may write now
+        standby_queue.clear();
+        if (id == connection_id)
+        {
+            writing_now = false;
+            write_next();
+        }
+        return;
+    }
+    standby_writing = false;
+    if (ec)
+        return drop_standby(ec, "standby write");
+    standby_queue.pop_front();
+    write_standby_next();
+}
+
+void client::drop_standby(boost::system::error_code ec, const char *what)
+{
+    if (standby == standby_state::none)
+        return;
+    if (ec)
+        fail(ec, what);
+    standby = standby_state::none;
+    standby_id = 0;
+    standby_resolver.cancel();
+    boost::system::error_code ignored;
+    standby_ws->next_layer().next_layer().close(ignored);
+    // A write in progress still uses its buffer, the queue is cleared when it completes
+    if (!standby_writing)
+        standby_queue.clear();
+    standby_reading = false;
+    standby_writing = false;
+}
+
+void client::promote_standby()
+{
+    info("Promoting the standby connection");
+    bool was_ready = handshake_completed;
+    // The replaced connection is closed, its completions are ignored
+    boost::system::error_code ignored;
+    ws_->next_layer().next_layer().close(ignored);
+    std::swap(ws_, standby_ws);
+    std::swap(buffer_, standby_buffer);
+    std::swap(handshake_response, standby_response);
+    compression_active = handshake_response[beast::http::field::sec_websocket_extensions].find("permessage-deflate") != boost::string_view::npos;
+    connection_id = standby_id;
+    // The read and write the standby has in progress now belong to the connection
+    reading_now = standby_reading;
+    writing_now = standby_writing;
+    if (!standby_writing)
+        standby_queue.clear();
+    standby = standby_state::none;
+    standby_id = 0;
+    standby_reading = false;
+    standby_writing = false;
+
+    write_queue.clear();
+    record_write_queue();
+    write_batch = 0;
+    retry_timer.cancel();
+    handshake_completed = true;
+    state = connection_state::ready;
+    retries = 0;
+    last_read_time = std::chrono::steady_clock::now();
+    failovers.fetch_add(1, std::memory_order_relaxed);
+    reconnects.fetch_add(1, std::memory_order_relaxed);
+    if (!reading_now)
+        do_read();
+    if (was_ready)
+    {
+        try
+        {handle_disconnected();}
+        catch(std::exception& e)
+        {
+            std::cerr << session_name << " Handle disconnected - " << e.what() << std::endl;
+        }
+    }
+    connection_ready();
+}
+
+void client::write_hello(int64_t opaque)
+{
+    if (!is_connected())
+        return;
+    json_writer& w = start_message();
+    w.StartObject();
+    w.Key("type");
+    w.String("hello");
+    w.Key("opaque");
+    w.Int64(opaque);
+    w.Key("protocol_version");
+    w.String("1.0");
+    w.EndObject();
+    write_next();
 }
 
 void client::write_pong(int64_t opaque)
 {
-    using namespace rapidjson;
-    Document doc(kObjectType);
-    doc.AddMember("type", Value(StringRef("pong")).Move(), doc.GetAllocator());
-    doc.AddMember("opaque", Value(opaque).Move(), doc.GetAllocator());
+    if (!is_connected())
+        return;
+    json_writer& w = start_message();
+    w.StartObject();
+    w.Key("type");
+    w.String("pong");
+    w.Key("opaque");
+    w.Int64(opaque);
+    w.EndObject();
+    write_next();
+}
 
-    write(doc);
+void client::write_get(int64_t opaque, const std::string &path)
+{
+    if (!is_connected())
+        return;
+    json_writer& w = start_message();
+    w.StartObject();
+    w.Key("type");
+    w.String("get");
+    w.Key("resource");
+    w.String(path.data(), static_cast<rapidjson::SizeType>(path.size()));
+    w.Key("opaque");
+    w.Int64(opaque);
+    w.EndObject();
+    write_next();
+}
+
+void client::write_subscribe(const std::string &channel_name)
+{
+    int64_t id = next_opaque();
+    if (!is_connected())
+        return;
+    json_writer& w = start_message();
+    w.StartObject();
+    w.Key("type");
+    w.String("subscribe");
+    w.Key("channel");
+    w.String(channel_name.data(), static_cast<rapidjson::SizeType>(channel_name.size()));
+    w.Key("opaque");
+    w.Int64(id);
+    w.EndObject();
+    write_next();
+}
+
+void client::write_unsubscribe(const std::string &channel_name)
+{
+    int64_t id = next_opaque();
+    if (!is_connected())
+        return;
+    json_writer& w = start_message();
+    w.StartObject();
+    w.Key("type");
+    w.String("unsubscribe");
+    w.Key("channel");
+    w.String(channel_name.data(), static_cast<rapidjson::SizeType>(channel_name.size()));
+    w.Key("opaque");
+    w.Int64(id);
+    w.EndObject();
+    write_next();
+}
+
+client::json_writer &client::start_message()
+{
+    write_stream.buffer = &write_queue.push();
+    writer.Reset(write_stream);
+    return writer;
 }
 
 }//bantam
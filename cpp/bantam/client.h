@@ -1,12 +1,15 @@
 #ifndef BANTAM_CLIENT_H
 #define BANTAM_CLIENT_H
 #include <chrono>
+#include <deque>
 #include <boost/beast.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/connect.hpp>
+#include <boost/utility/string_view.hpp>
 #include <algorithm>
 #include <cstdlib>
 #include <functional>
@@ -16,7 +19,9 @@
 #include <thread>
 #include <vector>
 #include <future>
-#include <list>
+#include <atomic>
+#include <mutex>
+#include <random>
 
 
 #define RAPIDJSON_HAS_STDSTRING 1
@@ -25,6 +30,18 @@
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include "binary_book.h"
+#include "channel_table.h"
+#include "client_stats.h"
+#include "conflated_order_book.h"
+#include "json_arena.h"
+#include "message_type.h"
+#include "order_book_decoder.h"
+#include "order_book_queue.h"
+#include "order_book_sequencer.h"
+#include "write_combining_stream.h"
+#include "write_ring.h"
+
 namespace bantam
 {
     namespace beast = boost::beast;
@@ -40,11 +57,83 @@ namespace bantam
         client_error(const std::string& message) : std::runtime_error(message){}
     };
 
+    // permessage-deflate settings, compression is only offered when enabled
+    struct compression_options
+    {
+        bool enabled = false;
+        // LZ77 window size of each direction, 9 to 15
+        int client_max_window_bits = 15;
+        int server_max_window_bits = 15;
+        // Reset the compression context after every message, saves memory at the cost of ratio
+        bool client_no_context_takeover = false;
+        bool server_no_context_takeover = false;
+        // zlib settings of outbound messages
+        int compression_level = 8;
+        int memory_level = 4;
+    };
+
+    // When and how a client reconnects. A lost connection is opened again after a delay
+    // that starts at initial_backoff and doubles with every failed attempt up to
+    // max_backoff, each delay randomly shortened by up to half so that many clients
+    // dropped together do not come back in lockstep.
+    struct reconnect_options
+    {
+        // Reconnect when nothing was read for this long, the server pings idle connections
+        std::chrono::milliseconds idle_timeout{30000};
+        std::chrono::milliseconds initial_backoff{100};
+        std::chrono::milliseconds max_backoff{10000};
+        // Subscribe again to all channels as soon as the new connection is ready. Otherwise
+        // the ready callback is called after every reconnect to restore them.
+        bool resubscribe = true;
+        // Resolved endpoints are reused for this long, or until connecting to them fails
+        std::chrono::seconds resolve_ttl{300};
+        // Keep a second connection open and through its hello while the first one is ready.
+        // When the first one fails, or nothing was read from it for failover_timeout, the
+        // standby takes its place without waiting for a connect and a handshake.
+        bool standby = false;
+        std::chrono::milliseconds failover_timeout{5000};
+    };
+
+    enum class connection_state
+    {
+        // Not started, or closed by the user
+        closed,
+        resolving, connecting, handshaking,
+        // WebSocket is open, waiting for the server hello
+        opening,
+        ready,
+        // Waiting out the backoff delay before reconnecting
+        waiting
+    };
+
+    // Message payload bytes and bytes on the wire, frame headers and HTTP upgrade included
+    struct traffic_stats
+    {
+        uint64_t raw_bytes_in = 0;
+        uint64_t wire_bytes_in = 0;
+        uint64_t raw_bytes_out = 0;
+        uint64_t wire_bytes_out = 0;
+        // Compression was negotiated on the current connection
+        bool compressed = false;
+    };
+
+    // All network work and callbacks of a client run on its strand. Public member functions
+    // may be called from any thread, they are forwarded to the strand when needed.
     struct client  : public std::enable_shared_from_this<client>
     {
         using json_callback_type = std::function<void(const rapidjson::Value& val)>;
+        using data_callback_type = std::function<void(channel_id channel, const rapidjson::Value& val)>;
+        using book_callback_type = std::function<void(const order_book_message& message)>;
+        using strand_type = asio::strand<asio::io_context::executor_type>;
+        // Maps a channel name to the resource holding its order book snapshot
+        using resource_name_type = std::function<std::string(const std::string& channel_name)>;
+        using stats_callback_type = std::function<void(const client_stats_snapshot& stats)>;
 
         static const size_t timer_period_seconds = 1;
+        // A snapshot requested to recover from a sequence gap is requested again after this
+        static const size_t recovery_timeout_seconds = 5;
+        // Max message size allowed by the protocol, the read buffer is reserved for it upfront
+        static const size_t max_message_size = 256 * 1024;
         // Resolver and socket require an io_context
         explicit client(
             boost::asio::io_context& ioc,
@@ -66,47 +155,185 @@ namespace bantam
             if (ready_callback)
                 ready_callback();
         }
+        // Called instead of handle_connected() when a connection comes back and its
+        // subscriptions were sent again
+        virtual void handle_reconnected()
+        {}
         virtual void handle_disconnected()
         {}
 
-        // Start the asynchronous operation
+        // Start the asynchronous operation. The callback is called once the connection is ready,
+        // and again after every reconnect if subscriptions are not restored automatically.
         void run(std::function<void()> _ready_callback);
+        // Closes the connection for good
         void stop();
 
         void open();
         void close();
         void reconnect();
+        // Safe to call from any thread, the stream itself is replaced on the strand
         bool is_connected() const
         {
-            return ws_.lowest_layer().is_open() && handshake_completed;
+            return handshake_completed;
         }
+        connection_state get_state() const
+        {return state;}
+        // Connections lost and opened again, failovers to the standby connection included
+        uint64_t get_reconnect_count() const
+        {return reconnects.load(std::memory_order_relaxed);}
+        uint64_t get_failover_count() const
+        {return failovers.load(std::memory_order_relaxed);}
+        // The standby connection is through its hello and can take over
+        bool has_standby() const
+        {return standby == standby_state::ready;}
         const std::string& get_session_name() const
         {return session_name;}
 
-        void subscribe(const std::string& channel_name, const json_callback_type& callback);
+        // Subscribes to a channel, the returned id is also passed to data callbacks
+        channel_id subscribe(const std::string& channel_name, const json_callback_type& callback);
+        channel_id subscribe(const std::string& channel_name, const data_callback_type& callback);
+        // Subscribes to an order book channel whose data messages are decoded without a DOM
+        // and applied directly to book, the callback is called after each applied message.
+        // The book is updated on the client strand, other threads must not access it.
+        template <typename Book>
+        channel_id subscribe_order_book(const std::string& channel_name, Book& book, const book_callback_type& callback = book_callback_type())
+        {
+            return subscribe_sink(channel_name, std::make_shared<basic_order_book_sink<Book>>(book), callback);
+        }
+        // Subscribes to an order book channel whose decoded messages are queued for a
+        // consumer thread, instead of being applied on the client strand
+        channel_id subscribe_order_book(const std::string& channel_name, order_book_queue& queue);
+        // Subscribes to an order book channel applied to a book whose best levels other
+        // threads read without locks
+        template <typename Book>
+        channel_id subscribe_conflated(const std::string& channel_name, conflated_order_book<Book>& book)
+        {
+            // The caller owns the book
+            std::shared_ptr<order_book_sink> sink(std::shared_ptr<order_book_sink>(), &book);
+            return subscribe_sink(channel_name, sink, [&book](const order_book_message& message){book.publish(message.timestamp);});
+        }
+        // Same with a caller provided sink
+        channel_id subscribe_sink(const std::string& channel_name, const std::shared_ptr<order_book_sink>& sink, const book_callback_type& callback);
+        const std::string& get_channel_name(channel_id id) const
+        {
+            std::lock_guard<std::mutex> lock(channels_mutex);
+            return channels.name(id);
+        }
         void get_resource(const std::string& path, const json_callback_type& callback);
 
         int64_t next_opaque()
         {return ++opaque;}
+
+        // How order book subscriptions recover from messages arriving out of sequence, by
+        // default they resubscribe. The resource mode reads a snapshot from the resource
+        // named by resource_name, whose content holds the bids and asks of the book like the
+        // data of a snapshot message, with optional sequence and timestamp fields.
+        void set_gap_recovery(gap_recovery mode, const resource_name_type& resource_name = resource_name_type());
+        // Counters of sequence gaps and recoveries, safe to read from any thread
+        const sequence_stats& get_sequence_stats() const
+        {return sequence_counters;}
+
+        void set_reconnect_options(const reconnect_options& options);
+
+        // Takes effect from the next connection
+        void set_compression(const compression_options& options);
+        traffic_stats get_traffic_stats() const;
+
+        // Max queued messages coalesced into one socket write
+        void set_max_write_batch(size_t n);
+        const strand_type& get_strand() const
+        {return strand_;}
+        // Counters of outbound frames and socket writes of all connections, safe to read
+        // from any thread
+        const write_stats& get_write_stats() const
+        {return wire_stats;}
+        // Counters of the inbound message parse arena, safe to read from any thread
+        const parse_stats& get_parse_stats() const
+        {return parse_arena.get_stats();}
+        // Per channel counters, latency histograms and connection counters, taken without
+        // locks from any thread
+        client_stats_snapshot get_stats_snapshot() const;
+        // Takes a snapshot every period on the strand and passes it to callback, or prints a
+        // summary without a callback. A zero period stops the dumps.
+        void set_stats_dump(std::chrono::seconds period, const stats_callback_type& callback = stats_callback_type());
     private:
+        using stream_type = websocket::stream<write_combining_stream>;
+
+        // Handlers of a connection attempt get its connection_id
         void on_resolve(
+            uint64_t id,
             boost::system::error_code ec,
             tcp::resolver::results_type results
         );
+        void start_connect(uint64_t id);
 
-        void on_connect(boost::system::error_code ec);
+        void on_connect(uint64_t id, boost::system::error_code ec);
 
-        void on_handshake(boost::system::error_code ec);
+        void on_handshake(uint64_t id, boost::system::error_code ec);
 
         void on_write(
+            uint64_t id,
             boost::system::error_code ec,
             std::size_t bytes_transferred);
 
+        // Reads of both connections complete here, a standby read goes to on_standby_read()
+        // until the standby is promoted, then its pending read is the connection's read
         void on_read(
+            uint64_t id,
             boost::system::error_code ec,
             std::size_t bytes_transferred);
 
         void on_close(boost::system::error_code ec);
+        // Drops the connection after a failure and opens a new one after the backoff delay
+        void retry(boost::system::error_code ec, const char* what);
+        void on_retry_timer(const boost::system::error_code& ec);
+        std::chrono::milliseconds next_backoff();
+        // Sends what the previous connection left unanswered once the new one is ready
+        void resubscribe();
+        void resend_resource_reads();
+        // Called once a connection is through the server hello
+        void connection_ready();
+        // Every connection gets a new stream
+        std::unique_ptr<stream_type> make_stream();
+        // Cached endpoints that did not outlive the resolve TTL
+        bool endpoints_fresh() const;
+        void cache_endpoints(const tcp::resolver::results_type& results);
+        websocket::permessage_deflate deflate_options() const;
+
+        // The standby connection goes through resolve, connect, handshake and the server
+        // hello like the connection, its handlers are bound to standby_id
+        void open_standby();
+        void on_standby_resolve(
+            uint64_t id,
+            boost::system::error_code ec,
+            tcp::resolver::results_type results);
+        void start_standby_connect(uint64_t id);
+        void on_standby_connect(uint64_t id, boost::system::error_code ec);
+        void on_standby_handshake(uint64_t id, boost::system::error_code ec);
+        void do_standby_read();
+        void on_standby_read(boost::system::error_code ec, std::size_t bytes_transferred);
+        void on_standby_write(uint64_t id, boost::system::error_code ec, std::size_t bytes_transferred);
+        // Answers the hello and pings, nothing is subscribed on the standby
+        void handle_standby_text(char* str);
+        void write_standby(int64_t opaque, const char* type);
+        void write_standby_next();
+        void drop_standby(boost::system::error_code ec, const char* what);
+        // Swaps the standby in for the connection
+        void promote_standby();
+
+        void handle_text(char* str);
+        // Text data is zero terminated at data + size
+        bool handle_order_book(const char* data, size_t size, bool binary);
+        // Runs decode(find, message) and calls the callback of the channel it applied to
+        template <typename Decode>
+        bool apply_order_book(Decode&& decode);
+        // Applies the compression field of the server hello
+        void check_compression(const rapidjson::Value& hello);
+        // Adds the message being read to the counters of its channel, parsed is the tick
+        // its parsing ended, timestamp its server time or 0
+        void record_message(channel_id id, int64_t timestamp, uint64_t parsed);
+        void record_write_queue();
+        void dump_stats();
 
         // Report a failure
         void fail(boost::system::error_code ec, char const* what)
@@ -119,6 +346,7 @@ namespace bantam
             std::cerr << " INFO [" << session_name << "] " << what << std::endl;
         }
 
+        // Milliseconds since the last message or the start of the connection
         int64_t last_read_elapsed() const;
 
         void write_next();
@@ -127,11 +355,51 @@ namespace bantam
         void do_read();
         void write_hello(int64_t opaque);
         void write_pong(int64_t opaque);
+        void write_get(int64_t opaque, const std::string& path);
+        void write_subscribe(const std::string& channel_name);
+        void write_unsubscribe(const std::string& channel_name);
+
+        using json_writer = rapidjson::Writer<write_ring::stream>;
+        // Returns the writer bound to a new buffer at the back of the write queue
+        json_writer& start_message();
+
+        struct channel_subscription
+        {
+            channel_id id = invalid_channel_id;
+            data_callback_type callback;
+            std::shared_ptr<order_book_sink> sink;
+            book_callback_type book_callback;
+            std::unique_ptr<order_book_sequencer> sequencer;
+        };
+        channel_id intern_channel(const std::string& channel_name);
+        channel_id find_channel(boost::string_view channel_name) const;
+        void sync_channels();
+        channel_subscription* find_book_subscription(const char* channel, size_t length);
+        channel_subscription& get_subscription(channel_id id);
+        void add_subscription(channel_id id, const std::string& channel_name, const data_callback_type& callback);
+        void add_book_subscription(channel_id id, const std::string& channel_name, const std::shared_ptr<order_book_sink>& sink, const book_callback_type& callback);
+        // Starts or retries the recovery of a book subscription from a sequence gap
+        void request_snapshot(channel_subscription& subscription);
+        void on_snapshot_resource(channel_id id, const rapidjson::Value& content);
+        // Replays a recovered snapshot and the updates buffered since the gap
+        void replay(channel_subscription& subscription);
     private:
-        bool handshake_completed = false;
+        std::atomic<bool> handshake_completed{false};
+        strand_type strand_;
         tcp::resolver resolver_;
-        websocket::stream<tcp::socket> ws_;
-        boost::beast::multi_buffer buffer_;
+        write_stats wire_stats;
+        // Held by pointer so a standby connection can take the place of the connection
+        std::unique_ptr<stream_type> ws_;
+        websocket::response_type handshake_response;
+        compression_options compression;
+        // Cleared when the server hello says it does not compress
+        bool server_compression = true;
+        std::atomic<bool> compression_active{false};
+        std::atomic<uint64_t> raw_bytes_in{0}, raw_bytes_out{0};
+        // The pending read of a stream keeps a reference to its buffer, so buffers are
+        // swapped along with the streams
+        std::unique_ptr<boost::beast::flat_buffer> buffer_;
+        json_arena parse_arena;
 
         boost::asio::deadline_timer timer;
 
@@ -139,18 +407,84 @@ namespace bantam
         const std::string path;
         const std::string port = "443";
 
-        std::chrono::system_clock::time_point last_read_time;
-        unsigned long reconnect_seconds = 30;
+        std::chrono::steady_clock::time_point last_read_time;
+        reconnect_options reconnection;
+        std::atomic<connection_state> state{connection_state::closed};
+        boost::asio::steady_timer retry_timer;
+        // Failed attempts since the last ready connection
+        unsigned retries = 0;
+        bool ever_ready = false;
+        std::atomic<uint64_t> reconnects{0}, failovers{0};
+        std::minstd_rand jitter;
+        // Endpoints of the last resolve, resolved again when they expire or fail
+        tcp::resolver::results_type endpoints;
+        std::chrono::steady_clock::time_point endpoints_resolved;
+        // Every connection attempt gets a new id, completions of older ones are ignored
+        uint64_t next_connection_id = 0;
+        uint64_t connection_id = 0;
         bool writing_now = false, reading_now = false;
+
+        enum class standby_state
+        {
+            none, connecting, opening, ready
+        };
+        tcp::resolver standby_resolver;
+        std::unique_ptr<stream_type> standby_ws;
+        std::unique_ptr<boost::beast::flat_buffer> standby_buffer;
+        websocket::response_type standby_response;
+        std::atomic<standby_state> standby{standby_state::none};
+        uint64_t standby_id = 0;
+        bool standby_reading = false, standby_writing = false;
+        std::deque<std::string> standby_queue;
+        size_t max_write_batch = 64;
+        size_t write_batch = 0;
         std::string session_name;
 
-        std::map<std::string, json_callback_type> subscriptions;
-        std::map<int64_t, json_callback_type> resource_reads;
+        // Channels are interned by the calling thread, the table is shared with the strand
+        mutable std::mutex channels_mutex;
+        channel_table channels;
+        // Copy the strand looks messages up in without locking. Channels are copied in id
+        // order when their subscription reaches the strand, so ids are the same in both.
+        channel_table strand_channels;
+        // Indexed by channel id. Entries never move, callbacks may subscribe to other
+        // channels while the entry running them is in use.
+        std::deque<channel_subscription> subscriptions;
+        size_t book_subscriptions = 0;
+        // Resource reads waiting for their response
+        struct resource_read
+        {
+            std::string path;
+            json_callback_type callback;
+        };
+        std::map<int64_t, resource_read> resource_reads;
+
+        order_book_decoder book_decoder;
+        binary_book_decoder binary_decoder;
+        gap_recovery recovery = gap_recovery::resubscribe;
+        resource_name_type snapshot_resource;
+        sequence_stats sequence_counters;
+
+        std::atomic<int64_t> opaque{0};
 
-        int64_t opaque = 0;
+        // Instrumentation, written on the strand and read by snapshots
+        tick_calibration tick_rate;
+        channel_stats_table channel_counters;
+        latency_histogram feed_latency, handling_time;
+        std::atomic<uint64_t> clock_skewed{0};
+        std::atomic<uint64_t> write_queue_depth{0}, max_write_queue_depth{0};
+        // Tick and size of the message being read
+        uint64_t read_ticks = 0;
+        size_t read_size = 0;
+        // System clock minus steady clock, turns receive times into server time
+        int64_t clock_offset_us = 0;
+        std::chrono::seconds stats_dump_period{0};
+        stats_callback_type stats_callback;
+        std::chrono::steady_clock::time_point last_stats_dump;
 
 
-        std::list<std::string> write_queue;
+        write_ring write_queue;
+        write_ring::stream write_stream;
+        json_writer writer;
         std::function<void()> ready_callback;
     };
 
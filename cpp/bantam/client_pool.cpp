@@ -0,0 +1,69 @@
+#include "client_pool.h"
+
+namespace bantam
+{
+
+client_pool::client_pool(size_t threads)
+{
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    contexts.reserve(threads);
+    guards.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        // Each io_context is run by a single thread. The hint spares asio waking other
+        // threads for new work, its mutexes stay since clients are called from any thread.
+        contexts.emplace_back(new boost::asio::io_context(1));
+        guards.push_back(boost::asio::make_work_guard(*contexts.back()));
+    }
+}
+
+client_pool::~client_pool()
+{
+    stop();
+}
+
+boost::asio::io_context &client_pool::next_context()
+{
+    return *contexts[next++ % contexts.size()];
+}
+
+void client_pool::run()
+{
+    if (!threads.empty())
+        return;
+    for (auto& ioc : contexts)
+    {
+        std::promise<void> done;
+        finished.push_back(done.get_future());
+        threads.emplace_back([&ioc](std::promise<void>&& done)
+        {
+            ioc->run();
+            done.set_value();
+        }, std::move(done));
+    }
+}
+
+void client_pool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (auto& c : clients)
+            c->stop();
+        clients.clear();
+    }
+    for (auto& guard : guards)
+        guard.reset();
+    // The clients send their close frames and wait for the answers
+    auto deadline = std::chrono::steady_clock::now() + close_timeout;
+    for (auto& f : finished)
+        f.wait_until(deadline);
+    for (auto& ioc : contexts)
+        ioc->stop();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    finished.clear();
+}
+
+}//bantam
@@ -0,0 +1,68 @@
+#ifndef BANTAM_CLIENT_POOL_H
+#define BANTAM_CLIENT_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include "client.h"
+
+namespace bantam
+{
+    // Runs clients on a pool of io_contexts with one thread each, so connections are spread
+    // over the cores and no io_context is shared between threads. Clients are handed out
+    // round-robin; each one still runs on its own strand.
+    struct client_pool
+    {
+        // Defaults to one io_context per hardware thread
+        explicit client_pool(size_t threads = 0);
+        ~client_pool();
+        client_pool(const client_pool&) = delete;
+        client_pool& operator=(const client_pool&) = delete;
+
+        size_t size() const
+        {return contexts.size();}
+        // io_context for the next client
+        boost::asio::io_context& next_context();
+
+        // Creates a Client constructed as Client(io_context&, args...) on the next io_context
+        template <typename Client = client, typename... Args>
+        std::shared_ptr<Client> create(Args&&... args)
+        {
+            auto c = std::make_shared<Client>(next_context(), std::forward<Args>(args)...);
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.push_back(c);
+            return c;
+        }
+
+        // Starts the pool threads
+        void run();
+        // Closes the clients and joins the pool threads once their io_contexts run out of
+        // work. io_contexts still busy after the close timeout, because a server does not
+        // answer the close, are stopped.
+        void stop();
+        void set_close_timeout(std::chrono::milliseconds timeout)
+        {close_timeout = timeout;}
+    private:
+        using work_guard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+        std::vector<work_guard> guards;
+        std::vector<std::thread> threads;
+        // Ready when the io_context of the thread ran out of work
+        std::vector<std::future<void>> finished;
+        std::chrono::milliseconds close_timeout{5000};
+        std::atomic<size_t> next{0};
+        std::mutex clients_mutex;
+        std::vector<pclient> clients;
+    };
+
+}//bantam
+#endif // BANTAM_CLIENT_POOL_H
@@ -0,0 +1,272 @@
+#ifndef BANTAM_CLIENT_STATS_H
+#define BANTAM_CLIENT_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BANTAM_TICKS_TSC 1
+#endif
+
+#include "channel_table.h"
+
+namespace bantam
+{
+    // Cheap monotonic counter for timing the message path, the time stamp counter where
+    // available. Ticks are converted to nanoseconds when a snapshot is taken.
+    struct tick_clock
+    {
+        static uint64_t now()
+        {
+#ifdef BANTAM_TICKS_TSC
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+    };
+
+    // Ticks to nanoseconds, measured against the steady clock since construction
+    struct tick_calibration
+    {
+        tick_calibration()
+            : start_ticks(tick_clock::now())
+            , start_time(std::chrono::steady_clock::now())
+        {}
+        double nanoseconds_per_tick() const
+        {
+#ifdef BANTAM_TICKS_TSC
+            uint64_t ticks = tick_clock::now() - start_ticks;
+            double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count());
+            return ticks > 0 && ns > 0 ? ns / static_cast<double>(ticks) : 1.0;
+#else
+            return 1.0;
+#endif
+        }
+    private:
+        const uint64_t start_ticks;
+        const std::chrono::steady_clock::time_point start_time;
+    };
+
+    // Adds to a counter that only one thread at a time writes and any thread reads,
+    // without the cost of a locked read-modify-write
+    inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+    {counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);}
+
+    // Copy of a latency_histogram, values scaled to the unit of the snapshot
+    struct latency_snapshot
+    {
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        // Multiplies raw values into the unit of the snapshot
+        double scale = 1.0;
+
+        // Value that p percent of the recorded values do not exceed, within the precision
+        // of the histogram buckets
+        double percentile(double p) const;
+        double max() const
+        {return percentile(100);}
+        double mean() const;
+    };
+
+    // Histogram of non-negative values with buckets of logarithmic size, in the manner of
+    // HdrHistogram: each power of two is split into 32 buckets, so any value is known
+    // within about 3%. Recording is a few instructions and a store, it must happen on one
+    // thread at a time, while snapshots may be taken from any thread.
+    struct latency_histogram
+    {
+        static const int sub_bucket_bits = 5;
+        static const size_t sub_buckets = size_t(1) << sub_bucket_bits;
+        // Values from 2^max_exponent up go to the last bucket
+        static const int max_exponent = 40;
+        static const size_t bucket_count = sub_buckets + (max_exponent - sub_bucket_bits) * sub_buckets;
+
+        void record(uint64_t value)
+        {
+            bump(counts[index(value)]);
+            bump(total);
+        }
+
+        static size_t index(uint64_t value)
+        {
+            if (value < sub_buckets)
+                return static_cast<size_t>(value);
+            int exponent = 63 - leading_zeros(value);
+            if (exponent >= max_exponent)
+                return bucket_count - 1;
+            int shift = exponent - sub_bucket_bits;
+            return sub_buckets + static_cast<size_t>(shift) * sub_buckets + static_cast<size_t>((value >> shift) - sub_buckets);
+        }
+        // Highest value that goes to bucket i
+        static uint64_t highest(size_t i)
+        {
+            if (i < sub_buckets)
+                return i;
+            size_t shift = (i - sub_buckets) / sub_buckets;
+            uint64_t sub = (i - sub_buckets) % sub_buckets + sub_buckets;
+            return ((sub + 1) << shift) - 1;
+        }
+
+        uint64_t count() const
+        {return total.load(std::memory_order_relaxed);}
+        latency_snapshot snapshot(double scale = 1.0) const
+        {
+            latency_snapshot s;
+            s.scale = scale;
+            s.counts.resize(bucket_count);
+            for (size_t i = 0; i < bucket_count; ++i)
+            {
+                s.counts[i] = counts[i].load(std::memory_order_relaxed);
+                s.count += s.counts[i];
+            }
+            return s;
+        }
+    private:
+        static int leading_zeros(uint64_t value)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_clzll(value);
+#else
+            int n = 0;
+            for (uint64_t bit = uint64_t(1) << 63; !(value & bit); bit >>= 1)
+                ++n;
+            return n;
+#endif
+        }
+
+        std::array<std::atomic<uint64_t>, bucket_count> counts{};
+        std::atomic<uint64_t> total{0};
+    };
+
+    inline double latency_snapshot::percentile(double p) const
+    {
+        if (!count)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(p / 100 * static_cast<double>(count) + 0.5);
+        rank = rank < 1 ? 1 : (rank > count ? count : rank);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return static_cast<double>(latency_histogram::highest(i)) * scale;
+        }
+        return static_cast<double>(latency_histogram::highest(counts.size() - 1)) * scale;
+    }
+
+    inline double latency_snapshot::mean() const
+    {
+        if (!count)
+            return 0;
+        double sum = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            if (!counts[i])
+                continue;
+            // Middle of the bucket
+            uint64_t low = i ? latency_histogram::highest(i - 1) + 1 : 0;
+            sum += static_cast<double>(counts[i]) * (static_cast<double>(low) + static_cast<double>(latency_histogram::highest(i))) / 2;
+        }
+        return sum / static_cast<double>(count) * scale;
+    }
+
+    // Counters of the messages of one channel, times are in tick_clock ticks
+    struct channel_stats
+    {
+        std::atomic<uint64_t> messages{0};
+        std::atomic<uint64_t> bytes{0};
+        // Parsing the message, and applying it for order book channels
+        std::atomic<uint64_t> parse_ticks{0};
+        // Running the subscription callback
+        std::atomic<uint64_t> callback_ticks{0};
+    };
+
+    struct channel_stats_snapshot
+    {
+        channel_id channel = invalid_channel_id;
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        double parse_ns = 0;
+        double callback_ns = 0;
+    };
+
+    // channel_stats indexed by channel id. Entries are allocated in chunks that never move,
+    // so readers walk the table without locks while the writer adds channels.
+    struct channel_stats_table
+    {
+        static const size_t chunk_size = 64;
+        static const size_t max_chunks = 1024;
+
+        channel_stats_table()
+        {
+            for (auto& c : chunks)
+                c.store(nullptr, std::memory_order_relaxed);
+        }
+        ~channel_stats_table()
+        {
+            for (auto& c : chunks)
+                delete c.load(std::memory_order_relaxed);
+        }
+        channel_stats_table(const channel_stats_table&) = delete;
+        channel_stats_table& operator=(const channel_stats_table&) = delete;
+
+        // Writer only. Channels past the capacity of the table share an entry that is not reported.
+        channel_stats& at(channel_id id)
+        {
+            size_t c = id / chunk_size;
+            if (c >= max_chunks)
+                return overflow;
+            chunk* p = chunks[c].load(std::memory_order_relaxed);
+            if (!p)
+            {
+                p = new chunk();
+                chunks[c].store(p, std::memory_order_release);
+            }
+            if (id >= count.load(std::memory_order_relaxed))
+                count.store(id + 1, std::memory_order_release);
+            return (*p)[id % chunk_size];
+        }
+        // Calls f(id, stats) for every channel, from any thread
+        template <typename F>
+        void for_each(F&& f) const
+        {
+            size_t n = count.load(std::memory_order_acquire);
+            for (size_t id = 0; id < n; ++id)
+            {
+                const chunk* p = chunks[id / chunk_size].load(std::memory_order_acquire);
+                if (p)
+                    f(static_cast<channel_id>(id), (*p)[id % chunk_size]);
+            }
+        }
+    private:
+        using chunk = std::array<channel_stats, chunk_size>;
+        std::array<std::atomic<chunk*>, max_chunks> chunks;
+        std::atomic<size_t> count{0};
+        channel_stats overflow;
+    };
+
+    // Point in time copy of the instrumentation of a client
+    struct client_stats_snapshot
+    {
+        // Channels that received messages
+        std::vector<channel_stats_snapshot> channels;
+        // Local receive time minus the server timestamp of data messages, in microseconds.
+        // Messages timestamped after they arrived, by a skewed clock, count as zero.
+        latency_snapshot feed_latency_us;
+        uint64_t clock_skewed = 0;
+        // From the read completing to the callbacks of the message returning, in nanoseconds
+        latency_snapshot handling_ns;
+        // Messages waiting in the write queue, now and at most since the client started
+        uint64_t write_queue_depth = 0;
+        uint64_t max_write_queue_depth = 0;
+        uint64_t reconnects = 0;
+        uint64_t failovers = 0;
+    };
+
+}//bantam
+#endif // BANTAM_CLIENT_STATS_H
@@ -0,0 +1,83 @@
+#ifndef BANTAM_CONFLATED_ORDER_BOOK_H
+#define BANTAM_CONFLATED_ORDER_BOOK_H
+
+#include <cstdint>
+
+#include "order_book.h"
+#include "order_book_decoder.h"
+#include "seqlock.h"
+
+namespace bantam
+{
+    // Best levels of a book, a volume of 0 means the side is empty
+    struct top_of_book
+    {
+        double bid_price = 0;
+        double bid_volume = 0;
+        double ask_price = 0;
+        double ask_volume = 0;
+        // Timestamp of the last message applied
+        int64_t timestamp = 0;
+        // Messages applied
+        uint64_t updates = 0;
+    };
+
+    // Order book kept up to date by the client strand, which publishes its best levels after
+    // every message. Any number of threads read them without locks and always see the
+    // latest state, however far behind they are. The book itself belongs to the strand.
+    template <typename Book = order_book>
+    struct conflated_order_book : public order_book_sink
+    {
+        using book_type = Book;
+
+        explicit conflated_order_book(const typename Book::levels_type& levels = typename Book::levels_type())
+            : book(levels)
+        {}
+
+        // Any thread
+        top_of_book get_top() const
+        {return top.load();}
+        uint64_t get_version() const
+        {return top.version();}
+
+        // Client strand
+        void clear() override
+        {book.clear();}
+        void update_level(order_book_side side, double price, double volume) override
+        {
+            if (!snapshot.update_level(side, price, volume))
+                book.update_level(side, price, volume);
+        }
+        void begin_snapshot() override
+        {snapshot.begin();}
+        void end_snapshot() override
+        {snapshot.end(book);}
+        void publish(int64_t timestamp)
+        {
+            const auto& levels = book.get_levels();
+            top_of_book t;
+            if (!book.get_bids().empty())
+            {
+                t.bid_price = levels.from_price(book.get_max_bid());
+                t.bid_volume = levels.from_volume(book.get_max_bid_vol());
+            }
+            if (!book.get_asks().empty())
+            {
+                t.ask_price = levels.from_price(book.get_min_ask());
+                t.ask_volume = levels.from_volume(book.get_min_ask_vol());
+            }
+            t.timestamp = timestamp;
+            t.updates = ++updates;
+            top.store(t);
+        }
+        const Book& get_book() const
+        {return book;}
+    private:
+        Book book;
+        order_book_snapshot<Book> snapshot;
+        uint64_t updates = 0;
+        seqlock<top_of_book> top;
+    };
+
+}//bantam
+#endif // BANTAM_CONFLATED_ORDER_BOOK_H
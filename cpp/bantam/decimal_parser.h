@@ -0,0 +1,218 @@
+#ifndef BANTAM_DECIMAL_PARSER_H
+#define BANTAM_DECIMAL_PARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#if !defined(BANTAM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BANTAM_DECIMAL_SSE 1
+#include <immintrin.h>
+#endif
+
+namespace bantam
+{
+    namespace detail
+    {
+        // 10^e for |e| <= 22, the powers of ten that are exact doubles
+        inline double power_of_ten(int e)
+        {
+            static const double powers[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+            };
+            return powers[e < 0 ? -e : e];
+        }
+
+        inline bool is_digit(char c)
+        {return static_cast<unsigned char>(c - '0') < 10;}
+
+        inline const char* skip_whitespace(const char* p, const char* end)
+        {
+            while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+                ++p;
+            return p;
+        }
+
+        // Value of a number with the given digits, computed the way rapidjson's default
+        // (not full precision) parsing does, so both give the same double
+        inline double decimal_value(uint64_t mantissa, size_t fraction_digits, bool fraction, bool minus)
+        {
+            if (!fraction)
+                return static_cast<double>(minus ? -static_cast<int64_t>(mantissa) : static_cast<int64_t>(mantissa));
+            double d = static_cast<double>(mantissa) / power_of_ten(static_cast<int>(fraction_digits));
+            return minus ? -d : d;
+        }
+
+        // Parses a JSON number at p and advances p past it. Returns false, leaving p alone,
+        // for numbers outside the exact fast path: exponents, more than 18 integer digits,
+        // significands above 2^53 and anything that is not a valid number.
+        inline bool parse_decimal(const char*& p, const char* end, double& value)
+        {
+            const char* s = p;
+            bool minus = s < end && *s == '-';
+            s += minus;
+            const char* digits = s;
+            uint64_t mantissa = 0;
+            while (s < end && is_digit(*s) && s - digits < 18)
+                mantissa = mantissa * 10 + static_cast<unsigned>(*s++ - '0');
+            if (s == digits || (s < end && is_digit(*s)) || (*digits == '0' && s - digits > 1))
+                return false;
+            bool fraction = s < end && *s == '.';
+            size_t fraction_digits = 0;
+            if (fraction)
+            {
+                const char* first = ++s;
+                while (s < end && is_digit(*s))
+                {
+                    // Where rapidjson leaves its exact integer significand
+                    if (mantissa > (uint64_t(1) << 53) - 1)
+                        return false;
+                    mantissa = mantissa * 10 + static_cast<unsigned>(*s++ - '0');
+                }
+                fraction_digits = static_cast<size_t>(s - first);
+                if (!fraction_digits || fraction_digits > 22)
+                    return false;
+            }
+            if (s < end && (*s == 'e' || *s == 'E'))
+                return false;
+            value = decimal_value(mantissa, fraction_digits, fraction, minus);
+            p = s;
+            return true;
+        }
+
+#ifdef BANTAM_DECIMAL_SSE
+        // Same as parse_decimal for numbers that fit in 16 bytes, which are converted with
+        // a handful of SSE instructions instead of a multiply per digit
+        __attribute__((target("sse4.1")))
+        inline bool parse_decimal_sse(const char*& p, const char* end, double& value)
+        {
+            const char* s = p;
+            bool minus = s < end && *s == '-';
+            s += minus;
+            if (end - s < 16)
+                return parse_decimal(p, end, value);
+
+            __m128i digits = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)), _mm_set1_epi8('0'));
+            __m128i is_digit = _mm_and_si128(
+                        _mm_cmpgt_epi8(digits, _mm_set1_epi8(-1)),
+                        _mm_cmplt_epi8(digits, _mm_set1_epi8(10)));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(is_digit));
+            unsigned integer_digits = static_cast<unsigned>(__builtin_ctz(~mask));
+            if (integer_digits == 0 || integer_digits >= 16)
+                return parse_decimal(p, end, value);
+            if (s[0] == '0' && integer_digits > 1)
+                return false;
+            unsigned length = integer_digits, fraction_digits = 0;
+            bool fraction = s[integer_digits] == '.';
+            if (fraction)
+            {
+                if (integer_digits + 1 >= 16)
+                    return parse_decimal(p, end, value);
+                fraction_digits = static_cast<unsigned>(__builtin_ctz(~(mask >> (integer_digits + 1))));
+                if (!fraction_digits)
+                    return false;
+                length += 1 + fraction_digits;
+                // The number may go on past the loaded bytes
+                if (length >= 16)
+                    return parse_decimal(p, end, value);
+            }
+            if (s[length] == 'e' || s[length] == 'E')
+                return false;
+
+            // Gather the digits right aligned, skipping the decimal point, leading lanes get
+            // a negative index which makes the shuffle zero them
+            int count = static_cast<int>(integer_digits + fraction_digits);
+            __m128i ordinal = _mm_sub_epi8(
+                        _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                        _mm_set1_epi8(static_cast<char>(16 - count)));
+            __m128i after_point = _mm_and_si128(
+                        _mm_cmpgt_epi8(ordinal, _mm_set1_epi8(static_cast<char>(integer_digits - 1))),
+                        _mm_set1_epi8(1));
+            digits = _mm_shuffle_epi8(digits, _mm_add_epi8(ordinal, after_point));
+
+            // Pairs, then groups of 4, then two groups of 8 digits
+            __m128i pairs = _mm_maddubs_epi16(digits, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+            __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+            quads = _mm_packus_epi32(quads, quads);
+            __m128i eights = _mm_madd_epi16(quads, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+            uint64_t mantissa = uint64_t(static_cast<uint32_t>(_mm_cvtsi128_si32(eights))) * 100000000
+                    + static_cast<uint32_t>(_mm_extract_epi32(eights, 1));
+
+            value = decimal_value(mantissa, fraction_digits, fraction, minus);
+            p = s + length;
+            return true;
+        }
+
+        inline bool has_sse41()
+        {
+            static const bool supported = __builtin_cpu_supports("sse4.1");
+            return supported;
+        }
+#endif
+
+        // Parses [number, number] pairs from just after the opening bracket of an array up to
+        // its closing bracket, returns the position of that bracket or nullptr if the text is
+        // not a plain array of pairs the parser can take
+        template <typename Parse>
+        inline const char* parse_pairs(const char* p, const char* end, std::vector<std::pair<double, double>>& pairs, Parse parse)
+        {
+            pairs.clear();
+            p = skip_whitespace(p, end);
+            if (p < end && *p == ']')
+                return p;
+            for (;;)
+            {
+                double first, second;
+                if (p == end || *p != '[')
+                    return nullptr;
+                p = skip_whitespace(p + 1, end);
+                if (!parse(p, end, first))
+                    return nullptr;
+                p = skip_whitespace(p, end);
+                if (p == end || *p != ',')
+                    return nullptr;
+                p = skip_whitespace(p + 1, end);
+                if (!parse(p, end, second))
+                    return nullptr;
+                p = skip_whitespace(p, end);
+                if (p == end || *p != ']')
+                    return nullptr;
+                pairs.emplace_back(first, second);
+                p = skip_whitespace(p + 1, end);
+                if (p == end)
+                    return nullptr;
+                if (*p == ']')
+                    return p;
+                if (*p != ',')
+                    return nullptr;
+                p = skip_whitespace(p + 1, end);
+            }
+        }
+
+#ifdef BANTAM_DECIMAL_SSE
+        __attribute__((target("sse4.1")))
+        inline const char* parse_pairs_sse(const char* p, const char* end, std::vector<std::pair<double, double>>& pairs)
+        {
+            return parse_pairs(p, end, pairs, [](const char*& s, const char* e, double& v) {return parse_decimal_sse(s, e, v);});
+        }
+#endif
+    }
+
+    // Parses an array of [price, volume] pairs, such as the levels of an order book message,
+    // from just after its opening bracket. Returns the position of the closing bracket, or
+    // nullptr if the array holds anything else or numbers that are left to rapidjson. The
+    // values are bit for bit those of rapidjson's default parsing. Uses SSE4.1 when the CPU
+    // has it.
+    inline const char* parse_decimal_pairs(const char* p, const char* end, std::vector<std::pair<double, double>>& pairs)
+    {
+#ifdef BANTAM_DECIMAL_SSE
+        if (detail::has_sse41())
+            return detail::parse_pairs_sse(p, end, pairs);
+#endif
+        return detail::parse_pairs(p, end, pairs, [](const char*& s, const char* e, double& v) {return detail::parse_decimal(s, e, v);});
+    }
+
+}//bantam
+#endif // BANTAM_DECIMAL_PARSER_H
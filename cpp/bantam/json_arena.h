@@ -0,0 +1,98 @@
+#ifndef BANTAM_JSON_ARENA_H
+#define BANTAM_JSON_ARENA_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/document.h>
+
+namespace bantam
+{
+    struct parse_stats
+    {
+        // Messages parsed through the arena
+        std::atomic<uint64_t> messages{0};
+        // Messages that outgrew the arena buffers and took heap chunks
+        std::atomic<uint64_t> heap_spills{0};
+        // Bytes of heap chunks taken by those messages
+        std::atomic<uint64_t> heap_bytes{0};
+        // Current size of the arena buffers
+        std::atomic<uint64_t> arena_bytes{0};
+    };
+
+    // Per-connection memory for parsing inbound messages. DOM values and the parse stack are
+    // carved out of preallocated buffers that are reset between messages, so steady-state
+    // parsing never reaches the heap. A message that does not fit spills into heap chunks,
+    // after which the outgrown buffer is enlarged to fit the next message of the same size.
+    struct json_arena
+    {
+        using allocator_type = rapidjson::MemoryPoolAllocator<>;
+        using document_type = rapidjson::GenericDocument<rapidjson::UTF8<>, allocator_type, allocator_type>;
+
+        // Initial parse stack size requested by a document, same as rapidjson's default
+        static const size_t document_stack_bytes = 1024;
+
+        explicit json_arena(size_t value_bytes = 64 * 1024, size_t stack_bytes = 16 * 1024)
+        {
+            values.reserve(value_bytes);
+            stack.reserve(stack_bytes);
+            stats.arena_bytes = values.bytes() + stack.bytes();
+        }
+        json_arena(const json_arena&) = delete;
+        json_arena& operator=(const json_arena&) = delete;
+
+        // Empty document allocating from the arena, valid until the next reset()
+        document_type document()
+        {return document_type(values.allocator.get(), document_stack_bytes, stack.allocator.get());}
+
+        // Releases everything allocated since the previous reset, no documents may be alive
+        void reset()
+        {
+            stats.messages.fetch_add(1, std::memory_order_relaxed);
+            size_t spilled = values.recycle() + stack.recycle();
+            if (spilled)
+            {
+                stats.heap_spills.fetch_add(1, std::memory_order_relaxed);
+                stats.heap_bytes.fetch_add(spilled, std::memory_order_relaxed);
+                stats.arena_bytes = values.bytes() + stack.bytes();
+            }
+        }
+
+        const parse_stats& get_stats() const
+        {return stats;}
+    private:
+        struct pool
+        {
+            std::vector<uint64_t> buffer;
+            std::unique_ptr<allocator_type> allocator;
+            size_t capacity = 0;
+
+            size_t bytes() const
+            {return buffer.size() * sizeof(uint64_t);}
+            void reserve(size_t n)
+            {
+                allocator.reset();
+                buffer.resize((n + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+                allocator.reset(new allocator_type(buffer.data(), bytes()));
+                capacity = allocator->Capacity();
+            }
+            // Returns the number of heap bytes the pool had to take
+            size_t recycle()
+            {
+                size_t spilled = allocator->Capacity() - capacity;
+                if (spilled)
+                    reserve(bytes() + spilled);
+                else allocator->Clear();
+                return spilled;
+            }
+        };
+
+        pool values, stack;
+        parse_stats stats;
+    };
+
+}//bantam
+#endif // BANTAM_JSON_ARENA_H
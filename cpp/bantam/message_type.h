@@ -0,0 +1,54 @@
+#ifndef BANTAM_MESSAGE_TYPE_H
+#define BANTAM_MESSAGE_TYPE_H
+
+#include <cstddef>
+#include <cstring>
+
+namespace bantam
+{
+    // Values of the "type" field of protocol messages
+    enum class message_type
+    {
+        unknown, hello, ping, pong, get, subscribe, subscribed, unsubscribe, unsubscribed, data, error
+    };
+
+    // Maps a "type" value to message_type by its length and first character, so only
+    // one candidate is ever compared and no string is constructed
+    inline message_type to_message_type(const char* str, size_t length)
+    {
+        auto is = [&](const char* name) {return !std::memcmp(str, name, length);};
+        switch (length)
+        {
+        case 3:
+            return is("get") ? message_type::get : message_type::unknown;
+        case 4:
+            switch (str[0])
+            {
+            case 'd': return is("data") ? message_type::data : message_type::unknown;
+            case 'p':
+                if (is("ping"))
+                    return message_type::ping;
+                return is("pong") ? message_type::pong : message_type::unknown;
+            }
+            break;
+        case 5:
+            switch (str[0])
+            {
+            case 'h': return is("hello") ? message_type::hello : message_type::unknown;
+            case 'e': return is("error") ? message_type::error : message_type::unknown;
+            }
+            break;
+        case 9:
+            return is("subscribe") ? message_type::subscribe : message_type::unknown;
+        case 10:
+            return is("subscribed") ? message_type::subscribed : message_type::unknown;
+        case 11:
+            return is("unsubscribe") ? message_type::unsubscribe : message_type::unknown;
+        case 12:
+            return is("unsubscribed") ? message_type::unsubscribed : message_type::unknown;
+        }
+        return message_type::unknown;
+    }
+
+}//bantam
+#endif // BANTAM_MESSAGE_TYPE_H
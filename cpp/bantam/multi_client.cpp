@@ -0,0 +1,277 @@
+#include "multi_client.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace bantam
+{
+
+namespace
+{
+    // Connection of a multi_client, which needs to know when it goes down
+    struct shard_client : public client
+    {
+        shard_client(
+            boost::asio::io_context& ioc,
+            const std::string& host,
+            const std::string& path,
+            const std::string& port,
+            std::function<void()> disconnected
+        )
+            : client(ioc, host, path, port)
+            , disconnected(std::move(disconnected))
+        {}
+
+        void handle_disconnected() override
+        {disconnected();}
+    private:
+        std::function<void()> disconnected;
+    };
+}
+
+multi_client::multi_client(client_pool &pool, const std::string &host, const std::string &path, const std::string &port, size_t connections, shard_policy policy)
+    : policy(policy)
+    , connections(connections ? connections : pool.size())
+{
+    // Channels of a connection that comes back are placed again by on_ready
+    reconnect_options options;
+    options.resubscribe = false;
+    for (size_t i = 0; i < this->connections.size(); ++i)
+    {
+        connection& c = this->connections[i];
+        c.client = pool.create<shard_client>(host, path, port, std::function<void()>(std::bind(&multi_client::on_disconnected, this, i)));
+        c.client->set_reconnect_options(options);
+    }
+}
+
+void multi_client::run(std::function<void ()> _ready_callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready_callback = _ready_callback;
+    }
+    for (size_t i = 0; i < connections.size(); ++i)
+        connections[i].client->run(std::bind(&multi_client::on_ready, this, i));
+}
+
+void multi_client::stop()
+{
+    for (auto& c : connections)
+        c.client->stop();
+}
+
+channel_id multi_client::subscribe(const std::string &channel_name, const json_callback_type &callback)
+{
+    return subscribe(channel_name, [callback](channel_id, const rapidjson::Value& val){callback(val);});
+}
+
+channel_id multi_client::subscribe(const std::string &channel_name, const data_callback_type &callback)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    channel_state& channel = add_channel(channel_name);
+    channel.callback = callback;
+    subscribe_channel(channel);
+    return channel.id;
+}
+
+channel_id multi_client::subscribe_sink(const std::string &channel_name, const std::shared_ptr<order_book_sink> &sink, const book_callback_type &callback)
+{
+    if (!sink)
+        throw client_error("Invalid argument value: sink");
+
+    std::lock_guard<std::mutex> lock(mutex);
+    channel_state& channel = add_channel(channel_name);
+    channel.sink = sink;
+    channel.book_callback = callback;
+    subscribe_channel(channel);
+    return channel.id;
+}
+
+void multi_client::get_resource(const std::string &path, const json_callback_type &callback)
+{
+    pclient c;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t index = next_resource++ % connections.size();
+        for (size_t i = 0; i < connections.size() && !connections[index].ready; ++i)
+            index = (index + 1) % connections.size();
+        c = connections[index].client;
+    }
+    c->get_resource(path, callback);
+}
+
+const std::string &multi_client::get_channel_name(channel_id id) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return channels.name(id);
+}
+
+size_t multi_client::get_channel_connection(channel_id id) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return states.at(id).connection;
+}
+
+double multi_client::get_channel_rate(channel_id id) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return rate(states.at(id), 0);
+}
+
+void multi_client::on_ready(size_t index)
+{
+    std::function<void()> callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        connections[index].ready = true;
+        connections[index].down = false;
+
+        // The connection lost its subscriptions. In load mode the channels waiting for
+        // connections lost and still down are placed again with them, heaviest first.
+        std::vector<channel_state*> moved;
+        for (auto& channel : states)
+            if (channel.connection == index || (policy == shard_policy::load && connections[channel.connection].down))
+                moved.push_back(&channel);
+        if (policy == shard_policy::load)
+        {
+            double fallback = default_rate();
+            std::sort(moved.begin(), moved.end(), [&](const channel_state* a, const channel_state* b)
+            {return rate(*a, fallback) > rate(*b, fallback);});
+            for (auto channel : moved)
+                channel->connection = connections.size();
+            for (auto channel : moved)
+                channel->connection = assign(*channel, fallback);
+        }
+        for (auto channel : moved)
+            subscribe_channel(*channel);
+
+        if (!ready_called)
+        {
+            ready_called = true;
+            callback = ready_callback;
+        }
+    }
+    if (callback)
+        callback();
+}
+
+void multi_client::on_disconnected(size_t index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    connections[index].ready = false;
+    connections[index].down = true;
+}
+
+multi_client::channel_state &multi_client::add_channel(const std::string &channel_name)
+{
+    channel_id id = channels.intern(channel_name);
+    if (id < states.size())
+        return states[id];
+    states.emplace_back(id, channel_name);
+    channel_state& channel = states.back();
+    if (policy == shard_policy::hash)
+        channel.connection = std::hash<std::string>()(channel_name) % connections.size();
+    else
+    {
+        channel.connection = connections.size();
+        channel.connection = assign(channel, default_rate());
+    }
+    return channel;
+}
+
+double multi_client::rate(const multi_client::channel_state &channel, double default_rate) const
+{
+    double seconds = std::chrono::duration<double>(clock::now() - channel.since).count();
+    uint64_t messages = channel.messages.load(std::memory_order_relaxed);
+    // Too early to tell, use the estimate
+    if (!messages || seconds < 1)
+        return default_rate;
+    return messages / seconds;
+}
+
+double multi_client::default_rate() const
+{
+    double total = 0;
+    size_t measured = 0;
+    for (const auto& channel : states)
+    {
+        double r = rate(channel, 0);
+        if (r > 0)
+        {
+            total += r;
+            ++measured;
+        }
+    }
+    return measured ? total / measured : 1;
+}
+
+size_t multi_client::assign(const multi_client::channel_state &channel, double default_rate) const
+{
+    // Load of each connection, channels not assigned yet have connection == size()
+    std::vector<double> loads(connections.size(), 0);
+    for (const auto& other : states)
+        if (&other != &channel && other.connection < connections.size())
+            loads[other.connection] += rate(other, default_rate);
+
+    // Connections not connected yet take their share, the channel waits for them, while
+    // connections that were lost are only used when all of them are
+    size_t best = connections.size();
+    for (int up = 1; up >= 0 && best == connections.size(); --up)
+    {
+        double best_load = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < connections.size(); ++i)
+        {
+            if (up && connections[i].down)
+                continue;
+            if (loads[i] < best_load)
+            {
+                best_load = loads[i];
+                best = i;
+            }
+        }
+    }
+    return best;
+}
+
+void multi_client::subscribe_channel(multi_client::channel_state &channel)
+{
+    connection& c = connections[channel.connection];
+    // Sent by on_ready once the connection is up
+    if (!c.ready)
+        return;
+    std::atomic<uint64_t>* messages = &channel.messages;
+    channel_id id = channel.id;
+    try
+    {
+        if (channel.callback)
+        {
+            data_callback_type callback = channel.callback;
+            c.client->subscribe(channel.name, [messages, id, callback](channel_id, const rapidjson::Value& val)
+            {
+                messages->fetch_add(1, std::memory_order_relaxed);
+                callback(id, val);
+            });
+        }
+        if (channel.sink)
+        {
+            book_callback_type callback = channel.book_callback;
+            c.client->subscribe_sink(channel.name, channel.sink, [messages, id, callback](const order_book_message& message)
+            {
+                messages->fetch_add(1, std::memory_order_relaxed);
+                if (callback)
+                {
+                    order_book_message m = message;
+                    m.channel = id;
+                    callback(m);
+                }
+            });
+        }
+    }
+    catch(client_error&)
+    {
+        // The connection went down, the channel is subscribed again when it is back
+        c.ready = false;
+    }
+}
+
+}//bantam
@@ -0,0 +1,127 @@
+#ifndef BANTAM_MULTI_CLIENT_H
+#define BANTAM_MULTI_CLIENT_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "channel_table.h"
+#include "client.h"
+#include "client_pool.h"
+
+namespace bantam
+{
+    // How multi_client assigns channels to connections
+    enum class shard_policy
+    {
+        // Fixed connection picked by the hash of the channel name
+        hash,
+        // Least loaded connection by measured message rate, rebalanced on reconnect
+        load
+    };
+
+    // Spreads the channels of one server over several client connections, so ingest is not
+    // serialised through a single socket. Offers the subscribe / get_resource API of client;
+    // channel ids are its own and are the ones passed to callbacks. New channels are spread
+    // over all connections that were not lost, ready or not; subscriptions made while their
+    // connection is not ready are sent once it is. In load mode, when a connection comes
+    // back after a reconnect its channels, and those of connections lost and still down,
+    // are reassigned to the least loaded connections, heaviest first. Callbacks run on the
+    // strand of the connection carrying the channel. The multi_client must outlive the pool
+    // threads running its connections.
+    struct multi_client
+    {
+        using json_callback_type = client::json_callback_type;
+        using data_callback_type = client::data_callback_type;
+        using book_callback_type = client::book_callback_type;
+
+        // Opens connections on the pool, one per pool thread if connections is 0
+        multi_client(
+            client_pool& pool,
+            const std::string& host,
+            const std::string& path,
+            const std::string& port,
+            size_t connections = 0,
+            shard_policy policy = shard_policy::load
+        );
+        multi_client(const multi_client&) = delete;
+        multi_client& operator=(const multi_client&) = delete;
+
+        // Starts all connections, the callback is called once the first one is ready
+        void run(std::function<void()> ready_callback);
+        void stop();
+
+        channel_id subscribe(const std::string& channel_name, const json_callback_type& callback);
+        channel_id subscribe(const std::string& channel_name, const data_callback_type& callback);
+        template <typename Book>
+        channel_id subscribe_order_book(const std::string& channel_name, Book& book, const book_callback_type& callback = book_callback_type())
+        {
+            return subscribe_sink(channel_name, std::make_shared<basic_order_book_sink<Book>>(book), callback);
+        }
+        // Same with a caller provided sink
+        channel_id subscribe_sink(const std::string& channel_name, const std::shared_ptr<order_book_sink>& sink, const book_callback_type& callback);
+        // Sent on the ready connections in turn
+        void get_resource(const std::string& path, const json_callback_type& callback);
+
+        const std::string& get_channel_name(channel_id id) const;
+        // Index of the connection carrying a channel
+        size_t get_channel_connection(channel_id id) const;
+        // Messages per second received on a channel since it was subscribed
+        double get_channel_rate(channel_id id) const;
+
+        size_t size() const
+        {return connections.size();}
+        const pclient& get_connection(size_t index) const
+        {return connections[index].client;}
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct channel_state
+        {
+            channel_state(channel_id id, const std::string& name)
+                : id(id)
+                , name(name)
+            {}
+            const channel_id id;
+            const std::string name;
+            size_t connection = 0;
+            data_callback_type callback;
+            std::shared_ptr<order_book_sink> sink;
+            book_callback_type book_callback;
+            std::atomic<uint64_t> messages{0};
+            clock::time_point since = clock::now();
+        };
+        struct connection
+        {
+            pclient client;
+            bool ready = false;
+            // Lost after it was ready, as opposed to not connected yet
+            bool down = false;
+        };
+
+        void on_ready(size_t index);
+        void on_disconnected(size_t index);
+        channel_state& add_channel(const std::string& channel_name);
+        double rate(const channel_state& channel, double default_rate) const;
+        double default_rate() const;
+        size_t assign(const channel_state& channel, double default_rate) const;
+        void subscribe_channel(channel_state& channel);
+
+        const shard_policy policy;
+        mutable std::mutex mutex;
+        channel_table channels;
+        // Channel states never move, callbacks keep pointers to them
+        std::deque<channel_state> states;
+        std::vector<connection> connections;
+        std::function<void()> ready_callback;
+        bool ready_called = false;
+        size_t next_resource = 0;
+    };
+
+}//bantam
+#endif // BANTAM_MULTI_CLIENT_H
@@ -0,0 +1,173 @@
+#ifndef BANTAM_NODE_POOL_H
+#define BANTAM_NODE_POOL_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace bantam
+{
+    // Single threaded pool of small fixed size blocks, such as the nodes of a std::map.
+    // Freed blocks go to a free list of their size class and are handed out again, so
+    // once the pool has grown to the peak number of nodes it never calls the global
+    // allocator. Memory is only returned when the pool is destroyed. Blocks larger than
+    // max_block_bytes are passed through to the global allocator.
+    struct node_pool
+    {
+        static const size_t granularity = 16;
+        static const size_t max_block_bytes = 256;
+
+        explicit node_pool(size_t chunk_bytes = 16 * 1024)
+            : chunk_bytes(chunk_bytes > max_block_bytes ? chunk_bytes : max_block_bytes)
+        {
+            free_lists.fill(nullptr);
+        }
+        node_pool(const node_pool&) = delete;
+        node_pool& operator=(const node_pool&) = delete;
+
+        // Pool shared by everything allocating from it on the calling thread. Users of the
+        // pool keep it alive, but must all run on one thread at a time.
+        static const std::shared_ptr<node_pool>& this_thread()
+        {
+            static thread_local std::shared_ptr<node_pool> pool = std::make_shared<node_pool>();
+            return pool;
+        }
+
+        void* allocate(size_t bytes)
+        {
+            if (bytes > max_block_bytes)
+                return ::operator new(bytes);
+            size_t c = size_class(bytes);
+            block* b = free_lists[c];
+            if (!b)
+                b = grow(c);
+            free_lists[c] = b->next;
+            ++blocks_used;
+            return b;
+        }
+        void deallocate(void* p, size_t bytes)
+        {
+            if (bytes > max_block_bytes)
+                return ::operator delete(p);
+            size_t c = size_class(bytes);
+            block* b = static_cast<block*>(p);
+            b->next = free_lists[c];
+            free_lists[c] = b;
+            --blocks_used;
+        }
+
+        // Bytes taken from the global allocator
+        size_t reserved_bytes() const
+        {return chunks.size() * chunk_bytes;}
+        // Blocks handed out and not yet returned
+        size_t used_blocks() const
+        {return blocks_used;}
+    private:
+        struct block
+        {
+            block* next;
+        };
+
+        static size_t size_class(size_t bytes)
+        {return bytes ? (bytes - 1) / granularity : 0;}
+
+        // Carves a new chunk into blocks of size class c
+        block* grow(size_t c)
+        {
+            size_t size = (c + 1) * granularity;
+            chunks.emplace_back(new char[chunk_bytes]);
+            char* p = chunks.back().get();
+            block* head = nullptr;
+            for (size_t n = chunk_bytes / size; n > 0; --n)
+            {
+                block* b = reinterpret_cast<block*>(p + (n - 1) * size);
+                b->next = head;
+                head = b;
+            }
+            return head;
+        }
+
+        size_t chunk_bytes;
+        std::array<block*, max_block_bytes / granularity> free_lists;
+        std::vector<std::unique_ptr<char[]>> chunks;
+        size_t blocks_used = 0;
+    };
+
+    // Allocator taking single objects from a node_pool. A default constructed allocator
+    // creates a pool of its own, or uses the pool of the constructing thread if
+    // ThreadShared is set; copies and rebound copies share the pool.
+    template <typename T, bool ThreadShared = false>
+    struct pool_allocator
+    {
+        using value_type = T;
+        // Containers moved or swapped take their pool along, copies get a pool of their own
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+        template <typename U>
+        struct rebind
+        {
+            using other = pool_allocator<U, ThreadShared>;
+        };
+
+        pool_allocator()
+            : pool(ThreadShared ? node_pool::this_thread() : std::make_shared<node_pool>())
+        {}
+        explicit pool_allocator(std::shared_ptr<node_pool> pool)
+            : pool(std::move(pool))
+        {}
+        // Moving copies the pool, a moved-from allocator must stay equal to what it was
+        // since the container it belongs to may allocate again
+        pool_allocator(const pool_allocator& other)
+            : pool(other.pool)
+        {}
+        pool_allocator(pool_allocator&& other)
+            : pool(other.pool)
+        {}
+        pool_allocator& operator=(const pool_allocator& other)
+        {
+            pool = other.pool;
+            return *this;
+        }
+        pool_allocator& operator=(pool_allocator&& other)
+        {
+            pool = other.pool;
+            return *this;
+        }
+        template <typename U>
+        pool_allocator(const pool_allocator<U, ThreadShared>& other)
+            : pool(other.get_pool())
+        {}
+
+        T* allocate(size_t n)
+        {
+            if (n != 1)
+                return static_cast<T*>(::operator new(n * sizeof(T)));
+            return static_cast<T*>(pool->allocate(sizeof(T)));
+        }
+        void deallocate(T* p, size_t n)
+        {
+            if (n != 1)
+                return ::operator delete(p);
+            pool->deallocate(p, sizeof(T));
+        }
+
+        pool_allocator select_on_container_copy_construction() const
+        {return pool_allocator();}
+        const std::shared_ptr<node_pool>& get_pool() const
+        {return pool;}
+    private:
+        std::shared_ptr<node_pool> pool;
+    };
+
+    template <typename T, typename U, bool ThreadShared>
+    bool operator==(const pool_allocator<T, ThreadShared>& a, const pool_allocator<U, ThreadShared>& b)
+    {return a.get_pool() == b.get_pool();}
+    template <typename T, typename U, bool ThreadShared>
+    bool operator!=(const pool_allocator<T, ThreadShared>& a, const pool_allocator<U, ThreadShared>& b)
+    {return a.get_pool() != b.get_pool();}
+
+}//bantam
+#endif // BANTAM_NODE_POOL_H
@@ -3,11 +3,22 @@
 
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <functional>
 #include <boost/assert.hpp>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <cmath>
+#include <cstdint>
+#include <array>
+#include <type_traits>
+#include <utility>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "node_pool.h"
 
 namespace bantam
 {
@@ -16,212 +27,1072 @@ namespace bantam
         bid, ask
     };
 
-    struct order_book_change
+    template <typename Price, typename Volume>
+    struct basic_order_book_change
     {
         order_book_side side;
-        double price;
-        double volume;
+        Price price;
+        Volume volume;
     };
 
-    struct order_book
+    using order_book_change = basic_order_book_change<double, double>;
+
+    // Level representation policies for basic_order_book. A policy names the price and
+    // volume types used as book keys and converts them from/to the decimal values
+    // carried by JSON messages.
+
+    // Prices and volumes are kept as doubles exactly as sent by the server
+    struct floating_levels
     {
         using price_type = double;
-        using map_type = std::map<price_type, double>;
+        using volume_type = double;
 
-        order_book() = default;
-        void clear()
+        price_type to_price(double price) const
+        {return price;}
+        volume_type to_volume(double volume) const
+        {return volume;}
+        double from_price(price_type price) const
+        {return price;}
+        double from_volume(volume_type volume) const
+        {return volume;}
+    };
+
+    // Prices are counted in ticks and volumes in lots of a per-channel size, so levels
+    // compare exactly and cheaply regardless of how the server formats decimals. The sizes
+    // must divide every price and volume of the channel: values off the grid are rounded to
+    // the nearest tick or lot, merging distinct levels, and counted. from_price() and
+    // from_volume() also take the fractional ticks and lots of averages.
+    struct fixed_levels
+    {
+        using price_type = int64_t;
+        using volume_type = int64_t;
+
+        explicit fixed_levels(double tick_size = 1e-8, double lot_size = 1e-8)
+            : tick_size(tick_size)
+            , lot_size(lot_size)
+            , ticks_per_unit(1 / tick_size)
+            , lots_per_unit(1 / lot_size)
         {
-            asks.clear();
-            bids.clear();
+            BOOST_VERIFY(tick_size > 0 && lot_size > 0);
         }
-        bool update(map_type& m, price_type price, double volume)
+
+        price_type to_price(double price) const
+        {return round(price * ticks_per_unit, rounded_prices);}
+        volume_type to_volume(double volume) const
+        {return round(volume * lots_per_unit, rounded_volumes);}
+        double from_price(double price) const
+        {return price * tick_size;}
+        double from_volume(double volume) const
+        {return volume * lot_size;}
+
+        double get_tick_size() const
+        {return tick_size;}
+        double get_lot_size() const
+        {return lot_size;}
+        // Prices and volumes converted so far that were not a whole number of ticks or lots
+        uint64_t get_rounded_prices() const
+        {return rounded_prices;}
+        uint64_t get_rounded_volumes() const
+        {return rounded_volumes;}
+    private:
+        // Rounds to the nearest integer, counting values further from it than the error of
+        // the decimal to binary conversion
+        static int64_t round(double units, uint64_t& rounded)
         {
-            BOOST_VERIFY(volume > 0);
-            auto it = m.find(price);
-            if (it == m.end())
+            double r = std::round(units);
+            if (std::abs(units - r) > 1e-6 + std::abs(units) * 8 * std::numeric_limits<double>::epsilon())
+                ++rounded;
+            return static_cast<int64_t>(r);
+        }
+
+        double tick_size, lot_size;
+        double ticks_per_unit, lots_per_unit;
+        // Conversions are const, counting them does not change the levels
+        mutable uint64_t rounded_prices = 0;
+        mutable uint64_t rounded_volumes = 0;
+    };
+
+    // One side of the book stored in a std::map ordered best price first.
+    template <typename Price, typename Volume, typename Better, typename Allocator = std::allocator<std::pair<const Price, Volume>>>
+    struct map_side
+    {
+        using map_type = std::map<Price, Volume, Better, Allocator>;
+
+        bool empty() const
+        {return levels.empty();}
+        size_t size() const
+        {return levels.size();}
+        void clear()
+        {levels.clear();}
+
+        bool update(Price price, Volume volume)
+        {
+            auto it = levels.find(price);
+            if (it == levels.end())
             {
-                m.emplace(price, volume);
+                levels.emplace(price, volume);
                 return true;
             }
-            else
+            bool changed = it->second != volume;
+            it->second = volume;
+            return changed;
+        }
+        bool remove(Price price)
+        {
+            auto it = levels.find(price);
+            if (it == levels.end())
+                return false;
+            levels.erase(it);
+            return true;
+        }
+        Volume add(Price price, Volume volume)
+        {
+            auto it = levels.find(price);
+            if (it == levels.end())
+                it = levels.emplace(price, volume).first;
+            else it->second += volume;
+            return it->second;
+        }
+
+        Price best_price() const
+        {return levels.begin()->first;}
+        Volume best_volume() const
+        {return levels.begin()->second;}
+        void pop_best()
+        {levels.erase(levels.begin());}
+
+        // Replaces the side with levels sorted best first in one pass over both, keeping the
+        // nodes of levels that stay. Calls changed(price, volume) for every level that was
+        // added, changed or removed (with a zero volume).
+        template <typename It, typename F>
+        void assign(It first, It last, F&& changed)
+        {
+            Better better;
+            auto it = levels.begin();
+            for (; first != last; ++first)
+            {
+                while (it != levels.end() && better(it->first, first->first))
+                {
+                    changed(it->first, Volume());
+                    it = levels.erase(it);
+                }
+                if (it != levels.end() && it->first == first->first)
+                {
+                    if (it->second != first->second)
+                    {
+                        it->second = first->second;
+                        changed(it->first, it->second);
+                    }
+                    ++it;
+                }
+                else
+                {
+                    levels.emplace_hint(it, first->first, first->second);
+                    changed(first->first, first->second);
+                }
+            }
+            while (it != levels.end())
             {
-                bool changed = it->second != volume;
-                it->second = volume;
+                changed(it->first, Volume());
+                it = levels.erase(it);
+            }
+        }
+
+        // Calls f(price, volume) from the best level to the worst one while f returns true
+        template <typename F>
+        void for_each(F&& f) const
+        {
+            for (const auto& l : levels)
+                if (!f(l.first, l.second))
+                    break;
+        }
+    private:
+        map_type levels;
+    };
+
+    // One side of the book stored in two contiguous arrays sorted worst price first,
+    // so the top of the book lives at the back and top-of-book inserts/erases are O(1).
+    template <typename Price, typename Volume, typename Better>
+    struct flat_side
+    {
+        // Number of levels scanned linearly from the top before falling back to a binary search
+        static const size_t linear_scan = 8;
+
+        bool empty() const
+        {return prices.empty();}
+        size_t size() const
+        {return prices.size();}
+        void clear()
+        {
+            prices.clear();
+            volumes.clear();
+        }
+        void reserve(size_t n)
+        {
+            prices.reserve(n);
+            volumes.reserve(n);
+        }
+
+        bool update(Price price, Volume volume)
+        {
+            size_t pos = upper(price);
+            if (pos && prices[pos - 1] == price)
+            {
+                bool changed = volumes[pos - 1] != volume;
+                volumes[pos - 1] = volume;
                 return changed;
             }
+            prices.insert(prices.begin() + pos, price);
+            volumes.insert(volumes.begin() + pos, volume);
+            return true;
+        }
+        bool remove(Price price)
+        {
+            size_t pos = upper(price);
+            if (!pos || prices[pos - 1] != price)
+                return false;
+            prices.erase(prices.begin() + (pos - 1));
+            volumes.erase(volumes.begin() + (pos - 1));
+            return true;
         }
-        bool update_bid(price_type price, double volume)
-        {return volume ? update(bids, price, volume) : remove_bid(price);}
-        bool update_ask(price_type price, double volume)
-        {return volume ? update(asks, price, volume) : remove_ask(price);}
-        bool remove(map_type& m, price_type price)
+        Volume add(Price price, Volume volume)
         {
-            auto it = m.find(price);
-            if (it != m.end())
+            size_t pos = upper(price);
+            if (pos && prices[pos - 1] == price)
+                return volumes[pos - 1] += volume;
+            prices.insert(prices.begin() + pos, price);
+            volumes.insert(volumes.begin() + pos, volume);
+            return volume;
+        }
+
+        Price best_price() const
+        {return prices.back();}
+        Volume best_volume() const
+        {return volumes.back();}
+        void pop_best()
+        {
+            prices.pop_back();
+            volumes.pop_back();
+        }
+
+        // Replaces the side with levels sorted best first, merging them with the current
+        // levels into spare arrays that are swapped in. Calls changed(price, volume) for
+        // every level that was added, changed or removed (with a zero volume).
+        template <typename It, typename F>
+        void assign(It first, It last, F&& changed)
+        {
+            Better better;
+            spare_prices.clear();
+            spare_volumes.clear();
+            size_t i = prices.size();
+            for (; first != last; ++first)
             {
-                m.erase(it);
+                while (i > 0 && better(prices[i - 1], first->first))
+                {
+                    --i;
+                    changed(prices[i], Volume());
+                }
+                if (i > 0 && prices[i - 1] == first->first)
+                {
+                    --i;
+                    if (volumes[i] != first->second)
+                        changed(first->first, first->second);
+                }
+                else changed(first->first, first->second);
+                spare_prices.push_back(first->first);
+                spare_volumes.push_back(first->second);
+            }
+            for (; i > 0; --i)
+                changed(prices[i - 1], Volume());
+            std::reverse(spare_prices.begin(), spare_prices.end());
+            std::reverse(spare_volumes.begin(), spare_volumes.end());
+            prices.swap(spare_prices);
+            volumes.swap(spare_volumes);
+        }
+
+        template <typename F>
+        void for_each(F&& f) const
+        {
+            for (size_t i = prices.size(); i > 0; --i)
+                if (!f(prices[i - 1], volumes[i - 1]))
+                    break;
+        }
+    private:
+        static bool worse(Price a, Price b)
+        {return Better()(b, a);}
+
+        // Index of the first level that is better than price
+        size_t upper(Price price) const
+        {
+            size_t pos = prices.size();
+            size_t stop = pos > linear_scan ? pos - linear_scan : 0;
+            while (pos > stop && worse(price, prices[pos - 1]))
+                --pos;
+            if (pos == stop && stop > 0)
+                pos = std::upper_bound(prices.begin(), prices.begin() + stop, price, &flat_side::worse) - prices.begin();
+            return pos;
+        }
+
+        std::vector<Price> prices;
+        std::vector<Volume> volumes;
+        // Storage of the previous levels, reused by assign()
+        std::vector<Price> spare_prices;
+        std::vector<Volume> spare_volumes;
+    };
+
+    namespace detail
+    {
+        inline size_t highest_bit(uint64_t bits)
+        {
+            BOOST_ASSERT(bits);
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanReverse64(&index, bits);
+            return index;
+#else
+            return 63 - __builtin_clzll(bits);
+#endif
+        }
+    }
+
+    // One side of the book stored as a price ladder: a ring of Size volumes indexed by the
+    // price in ticks, with a bitmap of non-empty levels. The window follows the best price
+    // and levels that fall behind it are kept in a flat overflow side. Prices are stored as
+    // keys growing towards the best price (asks are negated), so the best level is always
+    // the highest key in the window and every level in the overflow is worse than the window.
+    template <typename Price, typename Volume, typename Better, size_t Size>
+    struct ladder_side
+    {
+        static_assert(std::is_integral<Price>::value, "ladder_side requires tick prices, use fixed_levels");
+        static_assert(Size >= 64 && (Size & (Size - 1)) == 0, "ladder size must be a power of two");
+
+        // Distance kept between the best level and the top of the window after re-centring
+        static const Price headroom = Size / 4;
+
+        ladder_side()
+            : volumes(Size)
+        {
+            bitmap.fill(0);
+        }
+
+        bool empty() const
+        {return !count && overflow.empty();}
+        size_t size() const
+        {return count + overflow.size();}
+        void clear()
+        {
+            bitmap.fill(0);
+            count = 0;
+            overflow.clear();
+        }
+
+        bool update(Price price, Volume volume)
+        {
+            Price k = key(price);
+            if (!count || k > top)
+                recenter(k);
+            if (k <= bottom())
+                return overflow.update(price, volume);
+            size_t s = slot(k);
+            if (is_set(s))
+            {
+                bool changed = volumes[s] != volume;
+                volumes[s] = volume;
+                return changed;
+            }
+            set(s);
+            volumes[s] = volume;
+            if (!count++ || k > best)
+                best = k;
+            return true;
+        }
+        bool remove(Price price)
+        {
+            Price k = key(price);
+            if (!count || k > top)
+                return false;
+            if (k <= bottom())
+                return overflow.remove(price);
+            size_t s = slot(k);
+            if (!is_set(s))
+                return false;
+            reset(s);
+            --count;
+            if (k == best)
+                refresh_best();
+            return true;
+        }
+        Volume add(Price price, Volume volume)
+        {
+            Price k = key(price);
+            if (count && k <= top)
+            {
+                if (k <= bottom())
+                    return overflow.add(price, volume);
+                size_t s = slot(k);
+                if (is_set(s))
+                    return volumes[s] += volume;
+            }
+            update(price, volume);
+            return volume;
+        }
+
+        Price best_price() const
+        {return count ? key(best) : overflow.best_price();}
+        Volume best_volume() const
+        {return count ? volumes[slot(best)] : overflow.best_volume();}
+        void pop_best()
+        {
+            if (!count)
+                return overflow.pop_best();
+            reset(slot(best));
+            --count;
+            refresh_best();
+        }
+
+        // Replaces the side with levels sorted best first. Current levels are listed first,
+        // then only the differences are applied through update() and remove(). Calls
+        // changed(price, volume) for every level that was added, changed or removed (with
+        // a zero volume).
+        template <typename It, typename F>
+        void assign(It first, It last, F&& changed)
+        {
+            Better better;
+            current.clear();
+            for_each([&](Price price, Volume volume)
+            {
+                current.emplace_back(price, volume);
                 return true;
+            });
+            auto it = current.begin();
+            for (; first != last; ++first)
+            {
+                for (; it != current.end() && better(it->first, first->first); ++it)
+                {
+                    remove(it->first);
+                    changed(it->first, Volume());
+                }
+                if (it != current.end() && it->first == first->first)
+                {
+                    if (it->second != first->second)
+                    {
+                        update(first->first, first->second);
+                        changed(first->first, first->second);
+                    }
+                    ++it;
+                }
+                else
+                {
+                    update(first->first, first->second);
+                    changed(first->first, first->second);
+                }
+            }
+            for (; it != current.end(); ++it)
+            {
+                remove(it->first);
+                changed(it->first, Volume());
+            }
+        }
+
+        template <typename F>
+        void for_each(F&& f) const
+        {
+            if (count)
+            {
+                Price k = best;
+                do
+                {
+                    if (!f(key(k), volumes[slot(k)]))
+                        return;
+                }
+                while (k - 1 > bottom() && find_at_or_below(k - 1, k));
+            }
+            overflow.for_each(f);
+        }
+    private:
+        // Converts a price to a key and back, keys grow towards the best price
+        static Price key(Price price)
+        {return Better()(1, 0) ? price : -price;}
+        static size_t slot(Price k)
+        {return static_cast<size_t>(k) & (Size - 1);}
+        Price bottom() const
+        {return top - static_cast<Price>(Size);}
+
+        bool is_set(size_t s) const
+        {return bitmap[s / 64] & (uint64_t(1) << (s % 64));}
+        void set(size_t s)
+        {bitmap[s / 64] |= uint64_t(1) << (s % 64);}
+        void reset(size_t s)
+        {bitmap[s / 64] &= ~(uint64_t(1) << (s % 64));}
+
+        // Finds the highest non-empty key in (bottom(), k]
+        bool find_at_or_below(Price k, Price& found) const
+        {
+            size_t remaining = static_cast<size_t>(k - bottom());
+            size_t s = slot(k);
+            while (remaining)
+            {
+                size_t b = s % 64;
+                uint64_t bits = bitmap[s / 64] & ((uint64_t(2) << b) - 1);
+                if (remaining <= b)
+                    bits &= ~((uint64_t(1) << (b + 1 - remaining)) - 1);
+                if (bits)
+                {
+                    found = k - static_cast<Price>(b - detail::highest_bit(bits));
+                    return true;
+                }
+                if (remaining <= b + 1)
+                    break;
+                remaining -= b + 1;
+                k -= b + 1;
+                s = (s - b - 1) & (Size - 1);
             }
             return false;
         }
+
+        void refresh_best()
+        {
+            if (!count)
+            {
+                if (!overflow.empty())
+                    recenter(key(overflow.best_price()));
+                return;
+            }
+            find_at_or_below(best - 1, best);
+            if (top - best >= static_cast<Price>(Size) - headroom)
+                recenter(best);
+        }
+
+        // Moves the window so the best key sits headroom below its top. Levels that fall out
+        // of the window go to the overflow, overflow levels that fit into it are pulled back.
+        void recenter(Price new_best)
+        {
+            Price new_top = new_best + headroom;
+            if (count && new_top > top)
+            {
+                Price new_bottom = new_top - static_cast<Price>(Size);
+                for (size_t w = 0; w < bitmap.size(); ++w)
+                {
+                    for (uint64_t bits = bitmap[w]; bits; bits &= bits - 1)
+                    {
+                        size_t s = w * 64 + detail::highest_bit(bits & (~bits + 1));
+                        Price k = top - static_cast<Price>((slot(top) - s) & (Size - 1));
+                        if (k <= new_bottom)
+                        {
+                            overflow.update(key(k), volumes[s]);
+                            reset(s);
+                            --count;
+                        }
+                    }
+                }
+            }
+            top = new_top;
+            while (!overflow.empty() && key(overflow.best_price()) > bottom())
+            {
+                Price k = key(overflow.best_price());
+                size_t s = slot(k);
+                set(s);
+                volumes[s] = overflow.best_volume();
+                overflow.pop_best();
+                ++count;
+            }
+            if (count)
+                find_at_or_below(top, best);
+        }
+
+        std::vector<Volume> volumes;
+        std::array<uint64_t, Size / 64> bitmap;
+        size_t count = 0;
+        Price top = 0, best = 0;
+        flat_side<Price, Volume, Better> overflow;
+        // Levels listed by assign()
+        std::vector<std::pair<Price, Volume>> current;
+    };
+
+    // Running totals of one side of the book used by the depth queries. Levels are kept
+    // worst price first with the volume and notional of all worse levels, so the totals
+    // of the levels at or better than a price are a binary search away. A change only
+    // invalidates the entries at or better than its price, and those are rebuilt by the
+    // next query walking the side from the best level down, so churn at the top of the
+    // book costs little however deep the book is.
+    template <typename Price, typename Volume, typename Better>
+    struct cumulative_depth
+    {
+        void clear()
+        {valid = 0;}
+        void invalidate(Price price)
+        {
+            if (valid && !worse(prices[valid - 1], price))
+                valid = std::lower_bound(prices.begin(), prices.begin() + valid, price, &cumulative_depth::worse) - prices.begin();
+        }
+        template <typename Side>
+        void refresh(const Side& side)
+        {
+            size_t n = side.size();
+            if (valid == n && prices.size() == n)
+                return;
+            prices.resize(n);
+            volumes.resize(n + 1);
+            notionals.resize(n + 1);
+            size_t i = n;
+            side.for_each([&](Price price, Volume volume)
+            {
+                if (i == valid)
+                    return false;
+                --i;
+                prices[i] = price;
+                volumes[i + 1] = volume;
+                return true;
+            });
+            volumes[0] = Volume();
+            notionals[0] = 0;
+            for (i = valid; i < n; ++i)
+            {
+                notionals[i + 1] = notionals[i] + static_cast<double>(prices[i]) * static_cast<double>(volumes[i + 1]);
+                volumes[i + 1] += volumes[i];
+            }
+            valid = n;
+        }
+
+        size_t size() const
+        {return prices.size();}
+        Volume total_volume() const
+        {return volumes.back();}
+        // Volume of the levels at or better than price
+        Volume volume_to(Price price) const
+        {return volumes.back() - volumes[std::lower_bound(prices.begin(), prices.end(), price, &cumulative_depth::worse) - prices.begin()];}
+        // Index of the level at which the levels from the best one add up to volume,
+        // requires 0 < volume <= total_volume()
+        size_t level_for(Volume volume) const
+        {return std::upper_bound(volumes.begin(), volumes.end(), volumes.back() - volume) - volumes.begin() - 1;}
+        Price price(size_t i) const
+        {return prices[i];}
+        // Volume and notional of the levels better than level i
+        Volume volume_above(size_t i) const
+        {return volumes.back() - volumes[i + 1];}
+        double notional_above(size_t i) const
+        {return notionals.back() - notionals[i + 1];}
+    private:
+        static bool worse(Price a, Price b)
+        {return Better()(b, a);}
+
+        // volumes[i] and notionals[i] add up the levels before prices[i]
+        std::vector<Price> prices;
+        std::vector<Volume> volumes = std::vector<Volume>(1);
+        std::vector<double> notionals = std::vector<double>(1);
+        size_t valid = 0;
+    };
+
+    // Storage policies for basic_order_book
+    struct map_storage
+    {
+        template <typename Price, typename Volume, typename Better>
+        using side_type = map_side<Price, Volume, Better>;
+    };
+
+    // std::map sides whose nodes come from a node_pool, so level churn does not reach the
+    // global allocator. Each side has a pool of its own, or with ThreadShared all books
+    // share the pool of the thread that constructs them and must then stay on that thread.
+    template <bool ThreadShared = false>
+    struct pooled_map_storage
+    {
+        template <typename Price, typename Volume, typename Better>
+        using side_type = map_side<Price, Volume, Better, pool_allocator<std::pair<const Price, Volume>, ThreadShared>>;
+    };
+
+    struct flat_storage
+    {
+        template <typename Price, typename Volume, typename Better>
+        using side_type = flat_side<Price, Volume, Better>;
+    };
+
+    template <size_t Size = 1024>
+    struct ladder_storage
+    {
+        template <typename Price, typename Volume, typename Better>
+        using side_type = ladder_side<Price, Volume, Better, Size>;
+    };
+
+    template <typename Storage = map_storage, typename Levels = floating_levels>
+    struct basic_order_book
+    {
+        using levels_type = Levels;
+        using price_type = typename Levels::price_type;
+        using volume_type = typename Levels::volume_type;
+        using change_type = basic_order_book_change<price_type, volume_type>;
+        using bid_side_type = typename Storage::template side_type<price_type, volume_type, std::greater<price_type>>;
+        using ask_side_type = typename Storage::template side_type<price_type, volume_type, std::less<price_type>>;
+        using bid_depth_type = cumulative_depth<price_type, volume_type, std::greater<price_type>>;
+        using ask_depth_type = cumulative_depth<price_type, volume_type, std::less<price_type>>;
+
+        explicit basic_order_book(const levels_type& levels = levels_type())
+            : levels(levels)
+        {}
+        const levels_type& get_levels() const
+        {return levels;}
+        void clear()
+        {
+            asks.clear();
+            bids.clear();
+            ask_depth.clear();
+            bid_depth.clear();
+        }
+        bool update_bid(price_type price, volume_type volume)
+        {
+            if (!volume)
+                return remove_bid(price);
+            bid_depth.invalidate(price);
+            return update(bids, price, volume);
+        }
+        bool update_ask(price_type price, volume_type volume)
+        {
+            if (!volume)
+                return remove_ask(price);
+            ask_depth.invalidate(price);
+            return update(asks, price, volume);
+        }
         bool remove_bid(price_type price)
-        {return remove(bids, price);}
+        {
+            bid_depth.invalidate(price);
+            return bids.remove(price);
+        }
         bool remove_ask(price_type price)
-        {return remove(asks, price);}
+        {
+            ask_depth.invalidate(price);
+            return asks.remove(price);
+        }
+        // Applies a [price, volume] pair in decimal units as it arrives in a data message
+        bool update_level(order_book_side side, double price, double volume)
+        {
+            return side == order_book_side::bid
+                    ? update_bid(levels.to_price(price), levels.to_volume(volume))
+                    : update_ask(levels.to_price(price), levels.to_volume(volume));
+        }
+
+        const bid_side_type& get_bids() const
+        {return bids;}
+        const ask_side_type& get_asks() const
+        {return asks;}
 
         void print(std::ostream& out = std::cout, size_t max_size = 20) const
         {
             std::ostringstream os;
-            size_t skip_ask = asks.size() > max_size ? asks.size() - max_size : 0;
-            for (auto it = asks.rbegin(); it != asks.rend(); ++it)
+            std::vector<std::pair<price_type, volume_type>> top_asks;
+            asks.for_each([&](price_type p, volume_type v)
             {
-                if (skip_ask)
-                {
-                    skip_ask--;
-                    continue;
-                }
-                const auto& a = *it;
-                os << std::fixed << std::setprecision(8) << std::setw(16) << a.first << " - " << std::setw(4) << a.second << std::endl;
-            }
+                top_asks.emplace_back(p, v);
+                return top_asks.size() < max_size;
+            });
+            for (auto it = top_asks.rbegin(); it != top_asks.rend(); ++it)
+                os << std::fixed << std::setprecision(8) << std::setw(16) << levels.from_price(it->first) << " - " << std::setw(4) << levels.from_volume(it->second) << std::endl;
             os << "---" << std::endl;
             size_t num_bids = 0;
-            for (auto it = bids.rbegin(); it != bids.rend(); ++it)
+            bids.for_each([&](price_type p, volume_type v)
             {
-                const auto& a = *it;
-                os << std::fixed << std::setprecision(8) << std::setw(16) << a.first << " - " << std::setw(4) << a.second << std::endl;
-                if (++num_bids == max_size)
-                    break;
-            }
+                os << std::fixed << std::setprecision(8) << std::setw(16) << levels.from_price(p) << " - " << std::setw(4) << levels.from_volume(v) << std::endl;
+                return ++num_bids < max_size;
+            });
             out << os.str() << std::flush;
         }
+
+        // Prices and volumes taken and returned by the queries below are in book units,
+        // ticks and lots with fixed_levels, get_levels().from_price() and from_volume()
+        // convert them to decimals.
+
+        // Midpoint of the best bid and ask, the best price of the other side if one is empty
         double get_median_price() const
         {
             double median = 0;
             int num_sides = 0;
-            if (asks.size())
+            if (!asks.empty())
             {
-                median += asks.begin()->first;
+                median += asks.best_price();
                 num_sides++;
             }
-            if (bids.size())
+            if (!bids.empty())
             {
-                median += bids.rbegin()->first;
+                median += bids.best_price();
                 num_sides++;
             }
             if (num_sides)
                 median /= num_sides;
             return median;
         }
-        double get_min_ask() const
+        price_type get_min_ask() const
         {
             if (asks.empty())
-                return std::numeric_limits<double>::max();
-            return asks.begin()->first;
+                return std::numeric_limits<price_type>::max();
+            return asks.best_price();
         }
-        double get_min_ask_vol() const
+        volume_type get_min_ask_vol() const
         {
             if (asks.empty())
                 return 0;
-            return asks.begin()->second;
+            return asks.best_volume();
         }
-        double get_max_bid() const
+        price_type get_max_bid() const
         {
             if (bids.empty())
-                return std::numeric_limits<double>::min();
-            return bids.rbegin()->first;
+                return std::numeric_limits<price_type>::min();
+            return bids.best_price();
         }
-        double get_max_bid_vol() const
+        volume_type get_max_bid_vol() const
         {
             if (bids.empty())
                 return 0;
-            return bids.rbegin()->second;
+            return bids.best_volume();
+        }
+        struct depth
+        {
+            volume_type bids, asks;
+        };
+        // Volume of the levels within bps basis points of the median price on each side
+        depth depth_within(double bps) const
+        {
+            double median = get_median_price();
+            double range = median * bps / 10000;
+            return depth{
+                volume_to(order_book_side::bid, limit_price(median - range, true)),
+                volume_to(order_book_side::ask, limit_price(median + range, false))};
+        }
+        // Volume of the levels at or better than price
+        volume_type volume_to(order_book_side side, price_type price) const
+        {
+            if (side == order_book_side::bid)
+                return refreshed_bids().volume_to(price);
+            return refreshed_asks().volume_to(price);
+        }
+        // Average price of taking volume from the levels of side, NaN if the side holds less.
+        // The average of tick prices is a fraction of a tick.
+        double vwap_for_volume(order_book_side side, volume_type volume) const
+        {
+            if (side == order_book_side::bid)
+                return vwap(refreshed_bids(), volume);
+            return vwap(refreshed_asks(), volume);
+        }
+        // Worst price reached taking volume from the levels of side. If the side holds less,
+        // the same value as get_max_bid() or get_min_ask() of an empty side.
+        price_type price_for_volume(order_book_side side, volume_type volume) const
+        {
+            if (side == order_book_side::bid)
+                return reach(refreshed_bids(), volume, std::numeric_limits<price_type>::min());
+            return reach(refreshed_asks(), volume, std::numeric_limits<price_type>::max());
         }
-        void buy_partial(double max_price, double volume, std::vector<order_book_change>& changes)
+        // Copies up to n levels of side into out, best first, and returns how many
+        size_t top_levels(order_book_side side, change_type* out, size_t n) const
         {
-            for (auto it = bids.rbegin(); it != bids.rend() && volume > 0;)
+            size_t count = 0;
+            auto copy = [&](price_type p, volume_type v)
             {
-                double& v = it->second;
-                double p = it->first;
-                if (p >= max_price)
+                if (count == n)
+                    return false;
+                out[count++] = change_type{side, p, v};
+                return true;
+            };
+            if (side == order_book_side::bid)
+                bids.for_each(copy);
+            else asks.for_each(copy);
+            return count;
+        }
+
+        void buy_partial(price_type max_price, volume_type volume, std::vector<change_type>& changes)
+        {
+            while (!bids.empty() && volume > 0)
+            {
+                price_type p = bids.best_price();
+                if (p < max_price)
+                    break;
+                bid_depth.invalidate(p);
+                volume_type v = bids.best_volume();
+                if (v > volume)
                 {
-                    if (v > volume)
-                    {
-                        v -= volume;
-                        volume = 0;
-                    }
-                    else
-                    {
-                        BOOST_ASSERT(volume > 0);
-                        volume -= v;
-                        v = 0;
-                    }
-                    changes.push_back(order_book_change{order_book_side::bid, p, v});
-                    if (v == 0)
-                    {
-                        bids.erase(std::next(it).base());
-                    }
-                    else ++it;
+                    v -= volume;
+                    volume = 0;
+                    bids.update(p, v);
                 }
-                else break;
+                else
+                {
+                    BOOST_ASSERT(volume > 0);
+                    volume -= v;
+                    v = 0;
+                    bids.pop_best();
+                }
+                changes.push_back(change_type{order_book_side::bid, p, v});
             }
             if (volume > 0)
             {
-                auto it = asks.find(max_price);
-                if (it == asks.end())
-                    it = asks.emplace(max_price, volume).first;
-                else it->second += volume;
-                changes.push_back(order_book_change{order_book_side::ask, it->first, it->second});
+                ask_depth.invalidate(max_price);
+                changes.push_back(change_type{order_book_side::ask, max_price, asks.add(max_price, volume)});
             }
         }
-        void sell_partial(double min_price, double volume, std::vector<order_book_change>& changes)
+        void sell_partial(price_type min_price, volume_type volume, std::vector<change_type>& changes)
         {
-            for (auto it = asks.begin(); it != asks.end() && volume > 0;)
+            while (!asks.empty() && volume > 0)
             {
-                double& v = it->second;
-                double p = it->first;
-                if (p <= min_price)
+                price_type p = asks.best_price();
+                if (p > min_price)
+                    break;
+                ask_depth.invalidate(p);
+                volume_type v = asks.best_volume();
+                if (v > volume)
                 {
-                    if (v > volume)
-                    {
-                        v -= volume;
-                        volume = 0;
-                    }
-                    else
-                    {
-                        BOOST_ASSERT(volume > 0);
-                        volume -= v;
-                        v = 0;
-                    }
-                    changes.push_back(order_book_change{order_book_side::ask, p, v});
-                    if (v == 0)
-                        it = asks.erase(it);
-                    else ++it;
+                    v -= volume;
+                    volume = 0;
+                    asks.update(p, v);
+                }
+                else
+                {
+                    BOOST_ASSERT(volume > 0);
+                    volume -= v;
+                    v = 0;
+                    asks.pop_best();
                 }
-                else break;
+                changes.push_back(change_type{order_book_side::ask, p, v});
             }
             if (volume > 0)
             {
-                auto it = bids.find(min_price);
-                if (it == bids.end())
-                    it = bids.emplace(min_price, volume).first;
-                else it->second += volume;
-                changes.push_back(order_book_change{order_book_side::bid, it->first, it->second});
+                bid_depth.invalidate(min_price);
+                changes.push_back(change_type{order_book_side::bid, min_price, bids.add(min_price, volume)});
             }
         }
-        std::vector<order_book_change> snapshot() const
+        // Replaces the book with the levels of a snapshot, a range of changes in book units or
+        // of order_book_changes in decimal units, in any order. Levels are merged against the
+        // current ones in one sorted pass per side instead of rebuilding the book, and only
+        // the levels that actually changed are appended to changes, removed ones with a zero
+        // volume. Of repeated prices the last one wins, and a zero volume leaves the level out.
+        template <typename Range>
+        void apply_snapshot(const Range& range, std::vector<change_type>& changes)
         {
-            std::vector<order_book_change> res;
+            snapshot_bids.clear();
+            snapshot_asks.clear();
+            for (const auto& level : range)
+            {
+                change_type c = to_change(level);
+                (c.side == order_book_side::bid ? snapshot_bids : snapshot_asks).emplace_back(c.price, c.volume);
+            }
+            merge(bids, bid_depth, snapshot_bids, order_book_side::bid, changes);
+            merge(asks, ask_depth, snapshot_asks, order_book_side::ask, changes);
+        }
+        template <typename Range>
+        std::vector<change_type> apply_snapshot(const Range& range)
+        {
+            std::vector<change_type> changes;
+            apply_snapshot(range, changes);
+            return changes;
+        }
+
+        std::vector<change_type> snapshot() const
+        {
+            std::vector<change_type> res;
             res.reserve(bids.size() + asks.size());
-            for (auto& v : asks)
-                res.push_back(order_book_change{order_book_side::ask, v.first, v.second});
-            for (auto& v : bids)
-                res.push_back(order_book_change{order_book_side::bid, v.first, v.second});
+            asks.for_each([&](price_type p, volume_type v)
+            {
+                res.push_back(change_type{order_book_side::ask, p, v});
+                return true;
+            });
+            size_t first_bid = res.size();
+            bids.for_each([&](price_type p, volume_type v)
+            {
+                res.push_back(change_type{order_book_side::bid, p, v});
+                return true;
+            });
+            std::reverse(res.begin() + first_bid, res.end());
             return res;
         }
     private:
-        std::map<price_type, double> bids, asks;
+        template <typename Side>
+        static bool update(Side& side, price_type price, volume_type volume)
+        {
+            BOOST_VERIFY(volume > 0);
+            return side.update(price, volume);
+        }
+
+        const bid_depth_type& refreshed_bids() const
+        {
+            bid_depth.refresh(bids);
+            return bid_depth;
+        }
+        const ask_depth_type& refreshed_asks() const
+        {
+            ask_depth.refresh(asks);
+            return ask_depth;
+        }
+        template <typename Depth>
+        static double vwap(const Depth& depth, volume_type volume)
+        {
+            if (volume <= 0 || volume > depth.total_volume())
+                return std::numeric_limits<double>::quiet_NaN();
+            size_t i = depth.level_for(volume);
+            double rest = static_cast<double>(volume - depth.volume_above(i));
+            return (depth.notional_above(i) + static_cast<double>(depth.price(i)) * rest) / static_cast<double>(volume);
+        }
+        template <typename Depth>
+        static price_type reach(const Depth& depth, volume_type volume, price_type none)
+        {
+            if (!depth.size() || volume > depth.total_volume())
+                return none;
+            if (volume <= 0)
+                return depth.price(depth.size() - 1);
+            return depth.price(depth.level_for(volume));
+        }
+        // Rounds a limit in book units towards the inside of the book for tick prices
+        static price_type limit_price(double limit, bool up)
+        {
+            if (std::is_integral<price_type>::value)
+                return static_cast<price_type>(up ? std::ceil(limit) : std::floor(limit));
+            return static_cast<price_type>(limit);
+        }
+
+        change_type to_change(const change_type& change) const
+        {return change;}
+        template <typename Price, typename Volume>
+        change_type to_change(const basic_order_book_change<Price, Volume>& change) const
+        {return change_type{change.side, levels.to_price(change.price), levels.to_volume(change.volume)};}
+
+        using level_list = std::vector<std::pair<price_type, volume_type>>;
+
+        // Sorts snapshot levels best first, keeping the last of each price if it has a volume,
+        // and assigns them
+        template <typename Side, typename Depth>
+        static void merge(Side& side, Depth& depth, level_list& list, order_book_side s, std::vector<change_type>& changes)
+        {
+            auto better = [s](const typename level_list::value_type& a, const typename level_list::value_type& b)
+            {return s == order_book_side::bid ? a.first > b.first : a.first < b.first;};
+            if (!std::is_sorted(list.begin(), list.end(), better))
+                std::stable_sort(list.begin(), list.end(), better);
+            size_t n = 0;
+            for (size_t i = 0; i < list.size(); ++i)
+            {
+                if (n && list[n - 1].first == list[i].first)
+                    list[n - 1] = list[i];
+                else if (n && !list[n - 1].second)
+                    list[n - 1] = list[i];
+                else list[n++] = list[i];
+            }
+            if (n && !list[n - 1].second)
+                --n;
+            side.assign(list.begin(), list.begin() + n, [&](price_type price, volume_type volume)
+            {
+                depth.invalidate(price);
+                changes.push_back(change_type{s, price, volume});
+            });
+        }
+
+        levels_type levels;
+        bid_side_type bids;
+        ask_side_type asks;
+        // Snapshot levels being merged, kept to reuse their storage
+        level_list snapshot_bids, snapshot_asks;
+        // Brought up to date by the depth queries
+        mutable bid_depth_type bid_depth;
+        mutable ask_depth_type ask_depth;
     };
 
+    using order_book = basic_order_book<>;
+    using pooled_order_book = basic_order_book<pooled_map_storage<>>;
+    using flat_order_book = basic_order_book<flat_storage>;
+    using fixed_order_book = basic_order_book<flat_storage, fixed_levels>;
+    using ladder_order_book = basic_order_book<ladder_storage<>, fixed_levels>;
 
 }
 #endif // ORDER_BOOK_H
@@ -0,0 +1,321 @@
+#ifndef BANTAM_ORDER_BOOK_DECODER_H
+#define BANTAM_ORDER_BOOK_DECODER_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/reader.h>
+
+#include "channel_table.h"
+#include "decimal_parser.h"
+#include "message_type.h"
+#include "order_book.h"
+
+namespace bantam
+{
+    // Receives the levels of order book data messages
+    struct order_book_sink
+    {
+        virtual ~order_book_sink() = default;
+        virtual void clear() = 0;
+        virtual void update_level(order_book_side side, double price, double volume) = 0;
+        // The levels of a snapshot message come between these two calls, by default the
+        // snapshot clears the book and its levels are applied one by one
+        virtual void begin_snapshot()
+        {clear();}
+        virtual void end_snapshot()
+        {}
+    };
+
+    // Collects the levels of a snapshot so a book can apply_snapshot() them at once
+    template <typename Book>
+    struct order_book_snapshot
+    {
+        void begin()
+        {
+            levels.clear();
+            active = true;
+        }
+        // Returns false when no snapshot is being collected
+        bool update_level(order_book_side side, double price, double volume)
+        {
+            if (active)
+                levels.push_back(order_book_change{side, price, volume});
+            return active;
+        }
+        void end(Book& book)
+        {
+            active = false;
+            changes.clear();
+            book.apply_snapshot(levels, changes);
+        }
+    private:
+        std::vector<order_book_change> levels;
+        std::vector<typename Book::change_type> changes;
+        bool active = false;
+    };
+
+    template <typename Book>
+    struct basic_order_book_sink : public order_book_sink
+    {
+        explicit basic_order_book_sink(Book& book)
+            : book(book)
+        {}
+        void clear() override
+        {book.clear();}
+        void update_level(order_book_side side, double price, double volume) override
+        {
+            if (!snapshot.update_level(side, price, volume))
+                book.update_level(side, price, volume);
+        }
+        void begin_snapshot() override
+        {snapshot.begin();}
+        void end_snapshot() override
+        {snapshot.end(book);}
+    private:
+        Book& book;
+        order_book_snapshot<Book> snapshot;
+    };
+
+    // Summary of a data message applied to an order book
+    struct order_book_message
+    {
+        channel_id channel = invalid_channel_id;
+        int64_t timestamp = 0;
+        // Sequence number of the message, 0 if the server does not send one
+        uint64_t sequence = 0;
+        bool snapshot = false;
+        size_t levels = 0;
+    };
+
+    // SAX decoder of order book data messages. Levels are applied to the sink of the message
+    // channel while they are parsed, without building a DOM. Levels that arrive before the
+    // channel and content type are known are held back until the end of the message.
+    // Anything that is not a data message of a channel with a sink stops the decoder early,
+    // so the caller can handle the message on the DOM path.
+    struct order_book_decoder
+    {
+        // Find is called as find(const char* channel, size_t length) and returns the sink
+        // registered for the channel or nullptr. Returns false if the message was not applied.
+        template <typename Find>
+        bool decode(const char* json, Find&& find, order_book_message& message)
+        {return decode(json, std::strlen(json), find, message);}
+        // json is zero terminated at json + length
+        template <typename Find>
+        bool decode(const char* json, size_t length, Find&& find, order_book_message& message)
+        {
+            rapidjson::StringStream stream(json);
+            handler<Find> h(find, message, pending, pairs, stream, json + length);
+            bool parsed = !reader.Parse(stream, h).IsError();
+            if (parsed && h.finish())
+                return true;
+            if (h.applied)
+            {
+                h.abandon();
+                throw std::runtime_error("Malformed order book message");
+            }
+            return false;
+        }
+    private:
+        struct level
+        {
+            order_book_side side;
+            double price, volume;
+        };
+
+        enum class field
+        {
+            other, type, channel, timestamp, sequence, data, bids, asks
+        };
+
+        template <typename Find>
+        struct handler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, handler<Find>>
+        {
+            handler(Find& find, order_book_message& message, std::vector<level>& pending,
+                    std::vector<std::pair<double, double>>& pairs, rapidjson::StringStream& stream, const char* end)
+                : find(find)
+                , message(message)
+                , pending(pending)
+                , pairs(pairs)
+                , stream(stream)
+                , end(end)
+            {
+                pending.clear();
+            }
+
+            bool Default()
+            {return true;}
+            bool Int(int i)
+            {return Int64(i);}
+            bool Uint(unsigned i)
+            {return Int64(i);}
+            bool Int64(int64_t i)
+            {
+                if (depth == 1 && root_key == field::timestamp)
+                    message.timestamp = i;
+                if (depth == 1 && root_key == field::sequence)
+                    message.sequence = static_cast<uint64_t>(i);
+                return number(static_cast<double>(i));
+            }
+            bool Uint64(uint64_t i)
+            {return Int64(static_cast<int64_t>(i));}
+            bool Double(double d)
+            {
+                if (depth == 1 && root_key == field::timestamp)
+                    message.timestamp = static_cast<int64_t>(d);
+                return number(d);
+            }
+            bool String(const char* str, rapidjson::SizeType length, bool)
+            {
+                if (depth == 1 && root_key == field::type)
+                    return is_data = to_message_type(str, length) == message_type::data;
+                if (depth == 1 && root_key == field::channel)
+                    return (sink = find(str, static_cast<size_t>(length))) != nullptr;
+                if (depth == 2 && in_data && data_key == field::type)
+                {
+                    message.snapshot = equals(str, length, "snapshot");
+                    type_known = true;
+                }
+                return true;
+            }
+            bool Key(const char* str, rapidjson::SizeType length, bool)
+            {
+                if (depth == 1)
+                    root_key = key(str, length);
+                else if (depth == 2 && in_data)
+                    data_key = key(str, length);
+                return true;
+            }
+            bool StartObject()
+            {
+                if (depth == 1 && root_key == field::data)
+                    in_data = true;
+                ++depth;
+                return true;
+            }
+            bool EndObject(rapidjson::SizeType)
+            {
+                if (--depth == 1)
+                    in_data = false;
+                return true;
+            }
+            bool StartArray()
+            {
+                if (depth == 2 && in_data && (data_key == field::bids || data_key == field::asks))
+                {
+                    in_levels = true;
+                    side = data_key == field::bids ? order_book_side::bid : order_book_side::ask;
+                    // Take the whole array at once, the reader resumes at its closing bracket
+                    if (const char* close = parse_decimal_pairs(stream.src_, end, pairs))
+                    {
+                        stream.src_ = close;
+                        for (const auto& pair : pairs)
+                            apply(level{side, pair.first, pair.second});
+                    }
+                }
+                else if (depth == 3 && in_levels)
+                    level_index = 0;
+                ++depth;
+                return true;
+            }
+            bool EndArray(rapidjson::SizeType)
+            {
+                if (depth == 4 && in_levels && level_index >= 2)
+                    apply(level{side, level_values[0], level_values[1]});
+                if (--depth == 2)
+                    in_levels = false;
+                return true;
+            }
+
+            // Applies held back levels once the whole message has been read
+            bool finish()
+            {
+                if (!sink || !is_data)
+                    return false;
+                type_known = true;
+                for (const auto& l : pending)
+                    apply(l);
+                if (message.snapshot)
+                {
+                    if (!cleared)
+                        sink->begin_snapshot();
+                    sink->end_snapshot();
+                }
+                return true;
+            }
+
+            // Ends a snapshot cut short by a malformed message with the levels read so far
+            void abandon()
+            {
+                if (message.snapshot && cleared)
+                    sink->end_snapshot();
+            }
+
+            bool applied = false;
+        private:
+            bool number(double d)
+            {
+                if (depth == 4 && in_levels && level_index < 2)
+                    level_values[level_index++] = d;
+                return true;
+            }
+            void apply(const level& l)
+            {
+                if (!sink || !is_data || !type_known)
+                    return pending.push_back(l);
+                if (message.snapshot && !cleared)
+                {
+                    sink->begin_snapshot();
+                    cleared = true;
+                }
+                sink->update_level(l.side, l.price, l.volume);
+                applied = true;
+                ++message.levels;
+            }
+            static bool equals(const char* str, rapidjson::SizeType length, const char* value)
+            {return std::strlen(value) == length && !std::memcmp(str, value, length);}
+            static field key(const char* str, rapidjson::SizeType length)
+            {
+                if (equals(str, length, "type"))
+                    return field::type;
+                if (equals(str, length, "channel"))
+                    return field::channel;
+                if (equals(str, length, "timestamp"))
+                    return field::timestamp;
+                if (equals(str, length, "sequence"))
+                    return field::sequence;
+                if (equals(str, length, "data"))
+                    return field::data;
+                if (equals(str, length, "bids"))
+                    return field::bids;
+                if (equals(str, length, "asks"))
+                    return field::asks;
+                return field::other;
+            }
+
+            Find& find;
+            order_book_message& message;
+            std::vector<level>& pending;
+            std::vector<std::pair<double, double>>& pairs;
+            rapidjson::StringStream& stream;
+            const char* end;
+            order_book_sink* sink = nullptr;
+            int depth = 0;
+            field root_key = field::other, data_key = field::other;
+            bool is_data = false, type_known = false, cleared = false;
+            bool in_data = false, in_levels = false;
+            order_book_side side = order_book_side::bid;
+            int level_index = 0;
+            double level_values[2] = {0, 0};
+        };
+
+        rapidjson::Reader reader;
+        std::vector<level> pending;
+        std::vector<std::pair<double, double>> pairs;
+    };
+
+}//bantam
+#endif // BANTAM_ORDER_BOOK_DECODER_H
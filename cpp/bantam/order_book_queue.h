@@ -0,0 +1,89 @@
+#ifndef BANTAM_ORDER_BOOK_QUEUE_H
+#define BANTAM_ORDER_BOOK_QUEUE_H
+
+#include <vector>
+
+#include "order_book.h"
+#include "order_book_decoder.h"
+#include "spsc_ring.h"
+
+namespace bantam
+{
+    // Decoded order book data message handed to a consumer thread
+    struct order_book_update
+    {
+        order_book_message message;
+        std::vector<order_book_change> changes;
+    };
+
+    // Consecutive updates merge into one that applies both
+    inline void coalesce(order_book_update& into, order_book_update& from)
+    {
+        if (from.message.snapshot)
+            return std::swap(into, from);
+        into.changes.insert(into.changes.end(), from.changes.begin(), from.changes.end());
+        into.message.timestamp = from.message.timestamp;
+        into.message.sequence = from.message.sequence;
+        into.message.levels += from.message.levels;
+    }
+
+    // Snapshots are merged into the book, changes receives the levels that actually changed
+    template <typename Book>
+    void apply(Book& book, const order_book_update& update, std::vector<typename Book::change_type>& changes)
+    {
+        if (update.message.snapshot)
+            return book.apply_snapshot(update.changes, changes);
+        for (const auto& change : update.changes)
+        {
+            if (book.update_level(change.side, change.price, change.volume))
+            {
+                const auto& levels = book.get_levels();
+                changes.push_back(typename Book::change_type{change.side, levels.to_price(change.price), levels.to_volume(change.volume)});
+            }
+        }
+    }
+    template <typename Book>
+    void apply(Book& book, const order_book_update& update)
+    {
+        if (update.message.snapshot)
+            return static_cast<void>(book.apply_snapshot(update.changes));
+        for (const auto& change : update.changes)
+            book.update_level(change.side, change.price, change.volume);
+    }
+
+    // A queue must be fed by a single client, whose strand is the producer
+    using order_book_queue = spsc_ring<order_book_update>;
+
+    // Collects the levels of a message into the next queue item, commit() publishes it
+    struct queued_order_book_sink : public order_book_sink
+    {
+        explicit queued_order_book_sink(order_book_queue& queue)
+            : queue(queue)
+        {}
+        void clear() override
+        {current().changes.clear();}
+        void update_level(order_book_side side, double price, double volume) override
+        {current().changes.push_back(order_book_change{side, price, volume});}
+        void commit(const order_book_message& message)
+        {
+            current().message = message;
+            queue.commit();
+            update = nullptr;
+        }
+    private:
+        order_book_update& current()
+        {
+            if (!update)
+            {
+                update = &queue.prepare();
+                update->changes.clear();
+            }
+            return *update;
+        }
+
+        order_book_queue& queue;
+        order_book_update* update = nullptr;
+    };
+
+}//bantam
+#endif // BANTAM_ORDER_BOOK_QUEUE_H
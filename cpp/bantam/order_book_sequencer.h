@@ -0,0 +1,201 @@
+#ifndef BANTAM_ORDER_BOOK_SEQUENCER_H
+#define BANTAM_ORDER_BOOK_SEQUENCER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "order_book_decoder.h"
+#include "order_book_queue.h"
+
+namespace bantam
+{
+    // How a client resynchronises an order book whose messages arrived out of sequence
+    enum class gap_recovery
+    {
+        // Keep applying messages, gaps are only counted
+        none,
+        // Unsubscribe and subscribe again, the server answers with a snapshot
+        resubscribe,
+        // Read the snapshot with a get request for a resource named after the channel
+        resource
+    };
+
+    struct sequence_stats
+    {
+        // Messages that did not follow the previous one of their channel
+        std::atomic<uint64_t> gaps{0};
+        // Snapshots requested to recover from them
+        std::atomic<uint64_t> snapshot_requests{0};
+        // Recoveries completed, and buffered updates replayed on top of their snapshot
+        std::atomic<uint64_t> recoveries{0};
+        std::atomic<uint64_t> replayed{0};
+        // Buffered updates dropped, because they were older than the snapshot or did not fit
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    // Tracks the order of the messages of one order book channel. Messages carrying a
+    // sequence number must follow the previous one by exactly one, other messages must
+    // not go back in time. While in order, messages are applied to the channel sink as
+    // they are decoded. Once a message breaks the order, the channel recovers: messages
+    // are recorded into a buffer instead of the sink until a snapshot arrives, then the
+    // snapshot and the buffered updates that follow it are replayed to the sink.
+    struct order_book_sequencer : public order_book_sink
+    {
+        using clock = std::chrono::steady_clock;
+
+        explicit order_book_sequencer(sequence_stats& stats, size_t max_buffered = 4096)
+            : stats(stats)
+            , max_buffered(std::max<size_t>(max_buffered, 1))
+        {}
+
+        bool recovering() const
+        {return is_recovering;}
+        clock::time_point recovery_started() const
+        {return started;}
+
+        // Sink the levels of the next message go to
+        order_book_sink* route(order_book_sink* sink)
+        {
+            if (!is_recovering)
+                return sink;
+            current().changes.clear();
+            return this;
+        }
+        // Checks a message that was applied to the sink, false if it broke the sequence.
+        // With skip_gap the sequence carries on from a message that broke it, for books
+        // that are not recovered, so only the first message after each gap counts.
+        bool check(const order_book_message& message, bool skip_gap = false)
+        {
+            bool in_order = message.snapshot
+                    || (message.sequence ? !sequence || message.sequence == sequence + 1 : message.timestamp >= timestamp);
+            if (!in_order)
+            {
+                stats.gaps.fetch_add(1, std::memory_order_relaxed);
+                if (skip_gap)
+                    follow(message);
+                return false;
+            }
+            follow(message);
+            return true;
+        }
+        // Starts recording messages until the next snapshot
+        void recover()
+        {
+            if (!is_recovering)
+                buffered = 0;
+            is_recovering = true;
+            started = clock::now();
+        }
+        // Stores a message recorded while recovering, true once it is a snapshot to replay
+        bool record(const order_book_message& message)
+        {
+            current().message = message;
+            if (++buffered > max_buffered)
+            {
+                // Make room by dropping the oldest update
+                auto first = std::find_if(buffer.begin(), buffer.begin() + buffered, [](const order_book_update& u){return !u.message.snapshot;});
+                if (first != buffer.begin() + buffered)
+                {
+                    std::rotate(first, first + 1, buffer.begin() + buffered);
+                    --buffered;
+                    stats.dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            return message.snapshot;
+        }
+        // Replays the latest recorded snapshot and the updates that follow it to sink,
+        // calling applied(message) after each. Returns false if the updates still have a gap,
+        // in which case they stay buffered for the next snapshot.
+        template <typename F>
+        bool replay(order_book_sink& sink, F&& applied)
+        {
+            size_t snapshot = buffered;
+            while (snapshot > 0 && !buffer[snapshot - 1].message.snapshot)
+                --snapshot;
+            if (!snapshot--)
+                return false;
+            const order_book_update& s = buffer[snapshot];
+            sink.begin_snapshot();
+            for (const auto& change : s.changes)
+                sink.update_level(change.side, change.price, change.volume);
+            sink.end_snapshot();
+            sequence = 0;
+            follow(s.message);
+            applied(s.message);
+
+            size_t kept = 0;
+            bool in_order = true;
+            for (size_t i = 0; i < buffered; ++i)
+            {
+                order_book_update& u = buffer[i];
+                if (i == snapshot || (i < snapshot && u.message.snapshot))
+                    continue;
+                if (in_order && stale(u.message))
+                {
+                    stats.dropped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                if (in_order && check(u.message))
+                {
+                    for (const auto& change : u.changes)
+                        sink.update_level(change.side, change.price, change.volume);
+                    stats.replayed.fetch_add(1, std::memory_order_relaxed);
+                    applied(u.message);
+                    continue;
+                }
+                in_order = false;
+                std::swap(buffer[kept++], u);
+            }
+            buffered = kept;
+            if (!in_order)
+                return false;
+            is_recovering = false;
+            stats.recoveries.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        // Forgets the sequence and anything recorded, for a new subscription
+        void reset()
+        {
+            sequence = 0;
+            timestamp = 0;
+            buffered = 0;
+            is_recovering = false;
+        }
+
+        // Recording sink
+        void clear() override
+        {current().changes.clear();}
+        void update_level(order_book_side side, double price, double volume) override
+        {current().changes.push_back(order_book_change{side, price, volume});}
+    private:
+        order_book_update& current()
+        {
+            if (buffer.size() <= buffered)
+                buffer.resize(buffered + 1);
+            return buffer[buffered];
+        }
+        void follow(const order_book_message& message)
+        {
+            if (message.sequence)
+                sequence = message.sequence;
+            timestamp = message.timestamp;
+        }
+        // Already covered by the snapshot being replayed
+        bool stale(const order_book_message& message) const
+        {return message.sequence && sequence ? message.sequence <= sequence : message.timestamp < timestamp;}
+
+        sequence_stats& stats;
+        size_t max_buffered;
+        uint64_t sequence = 0;
+        int64_t timestamp = 0;
+        bool is_recovering = false;
+        clock::time_point started;
+        std::vector<order_book_update> buffer;
+        size_t buffered = 0;
+    };
+
+}//bantam
+#endif // BANTAM_ORDER_BOOK_SEQUENCER_H
@@ -0,0 +1,72 @@
+#ifndef BANTAM_SEQLOCK_H
+#define BANTAM_SEQLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace bantam
+{
+    // Single writer, many readers value. Readers copy the value and retry if the writer
+    // changed it meanwhile, so neither side ever waits on the other and readers always get
+    // the latest complete value. The value is held in atomic words, which keeps the racy
+    // copies well defined.
+    template <typename T>
+    struct seqlock
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "seqlock requires a trivially copyable type");
+
+        explicit seqlock(const T& value = T())
+        {
+            store(value);
+        }
+        seqlock(const seqlock&) = delete;
+        seqlock& operator=(const seqlock&) = delete;
+
+        // Writer thread only
+        void store(const T& value)
+        {
+            uint64_t buffer[word_count] = {};
+            std::memcpy(buffer, &value, sizeof(T));
+            uint64_t s = sequence.load(std::memory_order_relaxed);
+            sequence.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < word_count; ++i)
+                words[i].store(buffer[i], std::memory_order_relaxed);
+            sequence.store(s + 2, std::memory_order_release);
+        }
+        T load() const
+        {
+            uint64_t buffer[word_count];
+            for (;;)
+            {
+                uint64_t before = sequence.load(std::memory_order_acquire);
+                if (before & 1)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (size_t i = 0; i < word_count; ++i)
+                    buffer[i] = words[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == before)
+                    break;
+            }
+            T value;
+            std::memcpy(&value, buffer, sizeof(T));
+            return value;
+        }
+        // Number of stores, a reader can compare it to skip unchanged values
+        uint64_t version() const
+        {return sequence.load(std::memory_order_acquire) / 2;}
+    private:
+        static const size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> words[word_count];
+    };
+
+}//bantam
+#endif // BANTAM_SEQLOCK_H
@@ -0,0 +1,196 @@
+#ifndef BANTAM_SPSC_RING_H
+#define BANTAM_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/assert.hpp>
+
+namespace bantam
+{
+    // What spsc_ring does when an item is added to a full ring
+    enum class overflow_policy
+    {
+        // Discard the oldest queued item
+        drop_oldest,
+        // Merge the item into the newest queued one, see coalesce()
+        coalesce,
+        // Wait for the consumer
+        block
+    };
+
+    // Folds from into into for overflow_policy::coalesce, the default keeps the newest item.
+    // Overload it for item types that carry deltas.
+    template <typename T>
+    void coalesce(T& into, T& from)
+    {
+        std::swap(into, from);
+    }
+
+    // Bounded lock-free queue between one producer and one consumer thread. Items are
+    // filled in place and swapped out by the consumer, so items that own memory keep
+    // their capacity and steady-state hand-off does not allocate. Head and tail share one
+    // atomic word, which lets the producer drop the oldest item or take back the newest
+    // one to coalesce into it without racing the consumer.
+    template <typename T>
+    struct spsc_ring
+    {
+        // Capacity is rounded up to a power of two, at least 2
+        explicit spsc_ring(size_t capacity, overflow_policy policy = overflow_policy::drop_oldest)
+            : policy(policy)
+        {
+            size_t n = 2;
+            while (n < capacity)
+                n *= 2;
+            BOOST_ASSERT(n <= (size_t(1) << 31));
+            slots.resize(n);
+            mask = static_cast<uint32_t>(n - 1);
+        }
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+
+        size_t capacity() const
+        {return slots.size();}
+        overflow_policy get_policy() const
+        {return policy;}
+        // Items queued, approximate while the other side is running
+        size_t size() const
+        {
+            uint64_t s = state.load(std::memory_order_acquire);
+            return tail_of(s) - head_of(s);
+        }
+        // Items discarded by drop_oldest
+        uint64_t dropped() const
+        {return dropped_items.load(std::memory_order_relaxed);}
+        // Items merged into others by coalesce
+        uint64_t coalesced() const
+        {return coalesced_items.load(std::memory_order_relaxed);}
+
+        // Producer: returns the item to fill for the next commit(). The item holds stale
+        // content that the caller resets. Calling it again before commit() returns the same item.
+        T& prepare()
+        {
+            if (prepared)
+                return *prepared;
+            for (;;)
+            {
+                uint64_t s = state.load(std::memory_order_seq_cst);
+                uint32_t h = head_of(s), t = tail_of(s);
+                if (t - h < slots.size())
+                {
+                    wait_released(t - capacity32());
+                    prepared = &slots[t & mask];
+                    return *prepared;
+                }
+                switch (policy)
+                {
+                case overflow_policy::drop_oldest:
+                    if (state.compare_exchange_strong(s, pack(h + 1, t), std::memory_order_seq_cst))
+                        dropped_items.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                case overflow_policy::coalesce:
+                    // Decided at commit, the consumer may make room meanwhile
+                    prepared = &scratch;
+                    return *prepared;
+                case overflow_policy::block:
+                    std::this_thread::yield();
+                    break;
+                }
+            }
+        }
+        // Producer: publishes the prepared item
+        void commit()
+        {
+            BOOST_ASSERT(prepared);
+            T* item = prepared;
+            prepared = nullptr;
+            for (;;)
+            {
+                uint64_t s = state.load(std::memory_order_seq_cst);
+                uint32_t h = head_of(s), t = tail_of(s);
+                if (item != &scratch)
+                {
+                    if (state.compare_exchange_weak(s, pack(h, t + 1), std::memory_order_seq_cst))
+                        return;
+                }
+                else if (t - h < slots.size())
+                {
+                    wait_released(t - capacity32());
+                    std::swap(slots[t & mask], scratch);
+                    item = &slots[t & mask];
+                }
+                // Full, take back the newest item and merge into it
+                else if (state.compare_exchange_strong(s, pack(h, t - 1), std::memory_order_seq_cst))
+                {
+                    item = &slots[(t - 1) & mask];
+                    coalesce(*item, scratch);
+                    coalesced_items.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Consumer: swaps the oldest item into out, returns false if the ring is empty
+        bool try_pop(T& out)
+        {
+            for (;;)
+            {
+                uint64_t s = state.load(std::memory_order_seq_cst);
+                uint32_t h = head_of(s), t = tail_of(s);
+                if (h == t)
+                    return false;
+                // Announce the slot before claiming it, the producer does not reuse it
+                // until it is released
+                held.store(h, std::memory_order_seq_cst);
+                if (state.compare_exchange_weak(s, pack(h + 1, t), std::memory_order_seq_cst))
+                {
+                    std::swap(out, slots[h & mask]);
+                    held.store(none, std::memory_order_release);
+                    return true;
+                }
+                held.store(none, std::memory_order_release);
+            }
+        }
+    private:
+        // Positions wrap at 2^32, a slot is its position masked
+        static const uint64_t none = ~uint64_t(0);
+        static uint32_t head_of(uint64_t s)
+        {return static_cast<uint32_t>(s >> 32);}
+        static uint32_t tail_of(uint64_t s)
+        {return static_cast<uint32_t>(s);}
+        static uint64_t pack(uint32_t head, uint32_t tail)
+        {return (uint64_t(head) << 32) | tail;}
+        uint32_t capacity32() const
+        {return mask + 1;}
+
+        // The consumer may still be swapping out the item one lap behind, which takes no time
+        void wait_released(uint32_t position)
+        {
+            while (held.load(std::memory_order_seq_cst) == position)
+                std::this_thread::yield();
+        }
+
+        std::vector<T> slots;
+        uint32_t mask = 0;
+        const overflow_policy policy;
+
+        std::atomic<uint64_t> state{0};
+        char state_padding[64];
+        // Position the consumer is swapping out
+        std::atomic<uint64_t> held{none};
+        char held_padding[64];
+
+        // Producer only
+        T* prepared = nullptr;
+        T scratch;
+        std::atomic<uint64_t> dropped_items{0};
+        std::atomic<uint64_t> coalesced_items{0};
+    };
+
+    template <typename T>
+    const uint64_t spsc_ring<T>::none;
+
+}//bantam
+#endif // BANTAM_SPSC_RING_H
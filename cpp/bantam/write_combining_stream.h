@@ -0,0 +1,251 @@
+#ifndef BANTAM_WRITE_COMBINING_STREAM_H
+#define BANTAM_WRITE_COMBINING_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <boost/asio/associated_allocator.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/defer.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/core/saved_handler.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+
+namespace bantam
+{
+    struct write_stats
+    {
+        // Bytes and frames handed to the stream
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> frames{0};
+        // Socket writes issued for them
+        std::atomic<uint64_t> socket_writes{0};
+        // Bytes read from the socket
+        std::atomic<uint64_t> read_bytes{0};
+        // Frames that found the pending buffer full and waited for it to drain
+        std::atomic<uint64_t> stalls{0};
+    };
+
+    // Stream layer between a WebSocket stream and its TCP socket that coalesces writes.
+    // Frames are copied into a pending buffer that goes out with one socket write, and
+    // frames written while that write is in progress or while the stream is corked are
+    // sent together by the next one. Every frame, including control frames written by the
+    // WebSocket stream itself, passes through the same buffer, so they never interleave.
+    //
+    // Frames joining a write in progress or held back by cork() complete right away, so the
+    // caller can add the next one, up to max_pending_bytes. A frame that starts a socket
+    // write, or finds the buffer full, completes when that write ends, from its completion
+    // and with its error. The caller must use the executor of the socket, as it does with
+    // any Beast stream.
+    struct write_combining_stream
+    {
+        using socket_type = boost::asio::ip::tcp::socket;
+        using executor_type = socket_type::executor_type;
+        using next_layer_type = socket_type;
+        using lowest_layer_type = socket_type::lowest_layer_type;
+
+        // Takes an io_context or an executor, such as a strand, that the socket will use.
+        // Counters go to shared_stats if given, so successive streams add up to one total.
+        template <typename ExecutorOrContext>
+        explicit write_combining_stream(ExecutorOrContext&& ex, size_t max_batch_bytes = 64 * 1024, write_stats* shared_stats = nullptr)
+            : socket(std::forward<ExecutorOrContext>(ex))
+            , state(std::make_shared<write_state>())
+            , max_batch_bytes(max_batch_bytes)
+            , max_pending_bytes(std::max<size_t>(4 * max_batch_bytes, 1))
+            , stats(shared_stats ? *shared_stats : own_stats)
+        {}
+        ~write_combining_stream()
+        {state->detached = true;}
+
+        executor_type get_executor() noexcept
+        {return socket.get_executor();}
+        next_layer_type& next_layer()
+        {return socket;}
+        const next_layer_type& next_layer() const
+        {return socket;}
+        lowest_layer_type& lowest_layer()
+        {return socket.lowest_layer();}
+
+        // Max bytes sent by one socket write
+        void set_max_batch_bytes(size_t n)
+        {max_batch_bytes = std::max<size_t>(n, 1);}
+        // Pending bytes past which writes wait for the socket even while corked
+        void set_max_pending_bytes(size_t n)
+        {max_pending_bytes = std::max<size_t>(n, 1);}
+        const write_stats& get_stats() const
+        {return stats;}
+
+        // Holds frames back until uncork(), used while the caller has more frames to write
+        void cork()
+        {state->corked = true;}
+        void uncork()
+        {
+            state->corked = false;
+            flush();
+        }
+
+        template <typename MutableBufferSequence, typename ReadHandler>
+        BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(boost::system::error_code, std::size_t))
+        async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+        {
+            using completion_type = boost::asio::async_completion<ReadHandler, void(boost::system::error_code, std::size_t)>;
+            completion_type init(handler);
+            socket.async_read_some(buffers, counting_handler<typename completion_type::completion_handler_type>{
+                                       std::move(init.completion_handler), &stats.read_bytes});
+            return init.result.get();
+        }
+
+        template <typename ConstBufferSequence, typename WriteHandler>
+        BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(boost::system::error_code, std::size_t))
+        async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+        {
+            boost::asio::async_completion<WriteHandler, void(boost::system::error_code, std::size_t)> init(handler);
+            if (state->error)
+            {
+                boost::asio::post(socket.get_executor(), boost::beast::bind_handler(std::move(init.completion_handler), state->error, 0));
+                return init.result.get();
+            }
+            size_t size = 0;
+            for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+            {
+                boost::asio::const_buffer b(*it);
+                const char* data = static_cast<const char*>(b.data());
+                state->pending.insert(state->pending.end(), data, data + b.size());
+                size += b.size();
+            }
+            stats.bytes.fetch_add(size, std::memory_order_relaxed);
+            stats.frames.fetch_add(1, std::memory_order_relaxed);
+            if ((state->corked || state->writing_now) && state->pending.size() < max_pending_bytes)
+            {
+                // Deferred as a continuation of the caller's handler, the cheapest way to
+                // complete asynchronously
+                boost::asio::defer(socket.get_executor(), boost::beast::bind_handler(std::move(init.completion_handler), boost::system::error_code(), size));
+                return init.result.get();
+            }
+            if (state->pending.size() >= max_pending_bytes)
+                stats.stalls.fetch_add(1, std::memory_order_relaxed);
+            // The error is read when the write in progress ends
+            state->held.emplace_back();
+            state->held.back().emplace(boost::beast::bind_handler(std::move(init.completion_handler), std::cref(state->error), size));
+            flush();
+            return init.result.get();
+        }
+        // Adds the bytes transferred to a counter and calls the wrapped handler
+        template <typename Handler>
+        struct counting_handler
+        {
+            Handler handler;
+            std::atomic<uint64_t>* bytes;
+
+            void operator()(boost::system::error_code ec, std::size_t bytes_transferred)
+            {
+                bytes->fetch_add(bytes_transferred, std::memory_order_relaxed);
+                handler(ec, bytes_transferred);
+            }
+        };
+    private:
+        // Buffers are shared with the socket write in flight, which may complete after the
+        // stream is gone, in which case it is detached
+        struct write_state
+        {
+            std::vector<char> pending, sending;
+            // Completions of frames waiting for the write in progress
+            std::vector<boost::beast::saved_handler> held;
+            std::vector<boost::beast::saved_handler> completing;
+            size_t sent = 0;
+            bool writing_now = false;
+            bool corked = false;
+            bool detached = false;
+            boost::system::error_code error;
+        };
+
+        void flush()
+        {
+            if (state->writing_now || state->error)
+                return;
+            if (state->sent == state->sending.size())
+            {
+                if (state->pending.empty() || (state->corked && state->pending.size() < max_pending_bytes))
+                    return;
+                std::swap(state->pending, state->sending);
+                state->pending.clear();
+                state->sent = 0;
+            }
+            size_t size = std::min(state->sending.size() - state->sent, max_batch_bytes);
+            state->writing_now = true;
+            stats.socket_writes.fetch_add(1, std::memory_order_relaxed);
+            auto flushing = state;
+            boost::asio::async_write(
+                        socket,
+                        boost::asio::buffer(state->sending.data() + state->sent, size),
+                        [this, flushing](boost::system::error_code ec, std::size_t bytes_transferred)
+            {
+                flushing->writing_now = false;
+                if (flushing->detached)
+                    flushing->error = boost::asio::error::operation_aborted;
+                else
+                {
+                    flushing->sent += bytes_transferred;
+                    if (ec)
+                        flushing->error = ec;
+                    else flush();
+                }
+                // Handlers may write again, which holds new frames until the next write ends
+                std::swap(flushing->held, flushing->completing);
+                for (auto& h : flushing->completing)
+                    h.invoke();
+                flushing->completing.clear();
+            });
+        }
+
+        socket_type socket;
+        std::shared_ptr<write_state> state;
+        size_t max_batch_bytes;
+        size_t max_pending_bytes;
+        write_stats own_stats;
+        write_stats& stats;
+    };
+
+    inline void teardown(boost::beast::role_type role, write_combining_stream& stream, boost::system::error_code& ec)
+    {
+        using boost::beast::websocket::teardown;
+        teardown(role, stream.next_layer(), ec);
+    }
+
+    template <typename TeardownHandler>
+    void async_teardown(boost::beast::role_type role, write_combining_stream& stream, TeardownHandler&& handler)
+    {
+        using boost::beast::websocket::async_teardown;
+        async_teardown(role, stream.next_layer(), std::forward<TeardownHandler>(handler));
+    }
+
+}//bantam
+
+namespace boost
+{
+    namespace asio
+    {
+        // The wrapped handler keeps the executor and allocator of the handler it wraps
+        template <typename Handler, typename Executor>
+        struct associated_executor<bantam::write_combining_stream::counting_handler<Handler>, Executor>
+        {
+            using type = associated_executor_t<Handler, Executor>;
+            static type get(const bantam::write_combining_stream::counting_handler<Handler>& h, const Executor& ex = Executor()) noexcept
+            {return get_associated_executor(h.handler, ex);}
+        };
+        template <typename Handler, typename Allocator>
+        struct associated_allocator<bantam::write_combining_stream::counting_handler<Handler>, Allocator>
+        {
+            using type = associated_allocator_t<Handler, Allocator>;
+            static type get(const bantam::write_combining_stream::counting_handler<Handler>& h, const Allocator& a = Allocator()) noexcept
+            {return get_associated_allocator(h.handler, a);}
+        };
+    }
+}
+#endif // BANTAM_WRITE_COMBINING_STREAM_H
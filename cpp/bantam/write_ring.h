@@ -0,0 +1,86 @@
+#ifndef BANTAM_WRITE_RING_H
+#define BANTAM_WRITE_RING_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <boost/assert.hpp>
+
+namespace bantam
+{
+    // Queue of outbound messages stored in a ring of reusable buffers. Buffers keep their
+    // capacity after the message is sent, so once the ring has grown to the peak queue
+    // depth queuing a message does not allocate. Buffer data never moves while queued,
+    // even when the ring grows, so the front message can be handed to an async write.
+    struct write_ring
+    {
+        using buffer_type = std::vector<char>;
+
+        // rapidjson output stream appending to a ring buffer
+        struct stream
+        {
+            using Ch = char;
+            void Put(char c)
+            {buffer->push_back(c);}
+            void Flush()
+            {}
+            buffer_type* buffer = nullptr;
+        };
+
+        explicit write_ring(size_t slots = 16, size_t slot_bytes = 1024)
+            : slot_bytes(slot_bytes)
+        {
+            BOOST_ASSERT(slots > 0);
+            grow(slots);
+        }
+
+        bool empty() const
+        {return !count;}
+        size_t size() const
+        {return count;}
+
+        // Appends an empty buffer to the back of the queue
+        buffer_type& push()
+        {
+            if (count == slots.size())
+                grow(2 * slots.size());
+            buffer_type& buffer = slots[(head + count++) % slots.size()];
+            buffer.clear();
+            return buffer;
+        }
+        buffer_type& front()
+        {
+            BOOST_ASSERT(count);
+            return slots[head];
+        }
+        void pop_front()
+        {
+            BOOST_ASSERT(count);
+            head = (head + 1) % slots.size();
+            --count;
+        }
+        // Drops all queued messages, their buffers are kept
+        void clear()
+        {
+            head = 0;
+            count = 0;
+        }
+    private:
+        void grow(size_t n)
+        {
+            std::vector<buffer_type> grown(n);
+            for (size_t i = 0; i < slots.size(); ++i)
+                grown[i] = std::move(slots[(head + i) % slots.size()]);
+            for (size_t i = slots.size(); i < n; ++i)
+                grown[i].reserve(slot_bytes);
+            slots = std::move(grown);
+            head = 0;
+        }
+
+        std::vector<buffer_type> slots;
+        size_t head = 0, count = 0;
+        size_t slot_bytes;
+    };
+
+}//bantam
+#endif // BANTAM_WRITE_RING_H
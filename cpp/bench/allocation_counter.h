@@ -0,0 +1,10 @@
+#ifndef BANTAM_BENCH_ALLOCATION_COUNTER_H
+#define BANTAM_BENCH_ALLOCATION_COUNTER_H
+
+#include <cstdint>
+
+// Calls of the global operator new since the program started. The benchmarks run on one
+// thread, the count is not synchronised.
+uint64_t allocation_count();
+
+#endif // BANTAM_BENCH_ALLOCATION_COUNTER_H
@@ -0,0 +1,389 @@
+#include <bantam/binary_book.h>
+#include <bantam/client_stats.h>
+#include <bantam/order_book.h>
+#include <bantam/order_book_decoder.h>
+#include <bantam/order_book_sequencer.h>
+#include "allocation_counter.h"
+
+#include <CLI11.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct bench_options
+    {
+        std::string book = "ladder";
+        std::string filter;
+        size_t ops = 1000000;
+        size_t batch = 64;
+        size_t depth = 100;
+        double remove_ratio = 0.2;
+        std::string prices = "near";
+        size_t levels_per_message = 4;
+        size_t snapshot_every = 1000;
+        double tick_size = 0.01;
+        unsigned seed = 1;
+    };
+
+    // Keeps results alive so the optimiser does not drop the work producing them
+    volatile size_t sink_value = 0;
+
+    const bantam::tick_calibration tick_rate;
+
+    // Synthetic feed around a mid price. Levels are at most depth ticks away from the mid,
+    // either uniformly or mostly near the top of the book as in real feeds.
+    struct feed_generator
+    {
+        static constexpr double mid = 10000;
+
+        explicit feed_generator(const bench_options& options)
+            : options(options)
+            , random(options.seed)
+        {}
+
+        size_t offset()
+        {
+            size_t depth = std::max<size_t>(options.depth, 1);
+            if (options.prices == "uniform")
+                return std::uniform_int_distribution<size_t>(1, depth)(random);
+            double d = std::exponential_distribution<double>(8.0 / static_cast<double>(depth))(random);
+            return std::min<size_t>(1 + static_cast<size_t>(d), depth);
+        }
+        double price(bantam::order_book_side side, size_t offset) const
+        {
+            double ticks = std::round(mid / options.tick_size) + (side == bantam::order_book_side::bid ? -1.0 : 1.0) * static_cast<double>(offset);
+            return ticks * options.tick_size;
+        }
+        double volume(double max = 2)
+        {
+            return std::round(std::uniform_real_distribution<double>(1e-8, max)(random) * 1e8) / 1e8;
+        }
+        bantam::order_book_change next()
+        {
+            auto side = std::bernoulli_distribution(0.5)(random) ? bantam::order_book_side::bid : bantam::order_book_side::ask;
+            double v = std::bernoulli_distribution(options.remove_ratio)(random) ? 0 : volume();
+            return bantam::order_book_change{side, price(side, offset()), v};
+        }
+        // Every level of both sides
+        std::vector<bantam::order_book_change> full_book()
+        {
+            std::vector<bantam::order_book_change> levels;
+            for (size_t i = 1; i <= options.depth; ++i)
+                for (auto side : {bantam::order_book_side::bid, bantam::order_book_side::ask})
+                    levels.push_back(bantam::order_book_change{side, price(side, i), volume()});
+            return levels;
+        }
+
+        const bench_options& options;
+        std::mt19937_64 random;
+    };
+
+    int price_decimals(double tick_size)
+    {
+        return std::max(0, static_cast<int>(std::ceil(-std::log10(tick_size) - 1e-9)));
+    }
+
+    // Data messages as the server sends them: updates of levels_per_message levels, and a
+    // snapshot of the whole book every snapshot_every messages, the first one included
+    struct message_feed
+    {
+        struct message
+        {
+            bool snapshot;
+            uint64_t sequence;
+            int64_t timestamp;
+            std::vector<bantam::order_book_change> levels;
+        };
+
+        message_feed(const bench_options& options, size_t count)
+        {
+            feed_generator feed(options);
+            bantam::order_book truth;
+            truth.apply_snapshot(feed.full_book());
+            for (size_t i = 0; i < count; ++i)
+            {
+                message m;
+                m.snapshot = options.snapshot_every ? i % options.snapshot_every == 0 : i == 0;
+                m.sequence = i + 1;
+                m.timestamp = 1500000000000 + static_cast<int64_t>(i);
+                if (m.snapshot)
+                    m.levels = truth.snapshot();
+                else for (size_t j = 0; j < options.levels_per_message; ++j)
+                {
+                    m.levels.push_back(feed.next());
+                    truth.update_level(m.levels.back().side, m.levels.back().price, m.levels.back().volume);
+                }
+                messages.push_back(std::move(m));
+            }
+        }
+
+        std::vector<std::string> json(int decimals) const
+        {
+            std::vector<std::string> out;
+            char number[64];
+            for (const auto& m : messages)
+            {
+                std::string s = "{\"type\":\"data\",\"channel\":\"bench/BTCUSD\",\"timestamp\":" + std::to_string(m.timestamp)
+                        + ",\"sequence\":" + std::to_string(m.sequence)
+                        + ",\"data\":{\"type\":\"" + (m.snapshot ? "snapshot" : "update") + "\"";
+                for (auto side : {bantam::order_book_side::bid, bantam::order_book_side::ask})
+                {
+                    s += side == bantam::order_book_side::bid ? ",\"bids\":[" : ",\"asks\":[";
+                    bool first = true;
+                    for (const auto& l : m.levels)
+                    {
+                        if (l.side != side)
+                            continue;
+                        std::snprintf(number, sizeof(number), "%s[%.*f,%.8f]", first ? "" : ",", decimals, l.price, l.volume);
+                        s += number;
+                        first = false;
+                    }
+                    s += "]";
+                }
+                s += "}}";
+                out.push_back(std::move(s));
+            }
+            return out;
+        }
+
+        std::vector<std::vector<char>> binary(int decimals) const
+        {
+            std::vector<std::vector<char>> out;
+            bantam::binary_book_encoder encoder(-decimals, -8);
+            for (const auto& m : messages)
+            {
+                out.emplace_back();
+                encoder.encode(out.back(), "bench/BTCUSD", m.sequence, m.timestamp, m.snapshot, m.levels);
+            }
+            return out;
+        }
+
+        std::vector<message> messages;
+    };
+
+    void print_header()
+    {
+        std::printf("%-16s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+                    "benchmark", "ops", "ns/op", "allocs/op", "p50", "p90", "p99", "p99.9", "max");
+    }
+
+    // Times op(i) for i in [0, ops) in batches, resetting the state between batches
+    // outside of the measurement. Percentiles are of the mean ns/op of each batch.
+    struct runner
+    {
+        explicit runner(const bench_options& options)
+            : options(options)
+        {}
+
+        template <typename Op, typename Reset>
+        void run(const char* name, Op&& op, Reset&& reset)
+        {
+            if (!options.filter.empty() && std::string(name).find(options.filter) == std::string::npos)
+                return;
+            size_t batch = std::max<size_t>(options.batch, 1);
+            // Warm up caches, branch predictors and the pools of the book
+            for (size_t i = 0; i < std::min(options.ops, 16 * batch); ++i)
+                op(i);
+            reset();
+
+            bantam::latency_histogram batches;
+            uint64_t ticks = 0, allocated = 0;
+            for (size_t done = 0; done < options.ops;)
+            {
+                size_t n = std::min(batch, options.ops - done);
+                uint64_t a = allocation_count();
+                uint64_t start = bantam::tick_clock::now();
+                for (size_t j = 0; j < n; ++j)
+                    op(done + j);
+                uint64_t elapsed = bantam::tick_clock::now() - start;
+                allocated += allocation_count() - a;
+                ticks += elapsed;
+                // Hundredths of a tick, so fast operations keep their precision
+                batches.record(elapsed * 100 / n);
+                done += n;
+                reset();
+            }
+
+            double ns_per_tick = tick_rate.nanoseconds_per_tick();
+            bantam::latency_snapshot s = batches.snapshot(ns_per_tick / 100);
+            double ops = static_cast<double>(std::max<size_t>(options.ops, 1));
+            std::printf("%-16s %10zu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                        name, options.ops, static_cast<double>(ticks) * ns_per_tick / ops, static_cast<double>(allocated) / ops,
+                        s.percentile(50), s.percentile(90), s.percentile(99), s.percentile(99.9), s.max());
+        }
+        template <typename Op>
+        void run(const char* name, Op&& op)
+        {run(name, op, []{});}
+
+        const bench_options& options;
+    };
+
+    template <typename Book>
+    void run_book(const bench_options& options, const typename Book::levels_type& levels)
+    {
+        using change_type = typename Book::change_type;
+        runner r(options);
+        feed_generator feed(options);
+        const std::vector<bantam::order_book_change> full = feed.full_book();
+        std::vector<change_type> changes, reset_changes;
+
+        // Level updates of a feed, in book units
+        {
+            Book book(levels);
+            book.apply_snapshot(full);
+            std::vector<change_type> updates;
+            for (size_t i = 0; i < std::min<size_t>(options.ops, 1 << 20); ++i)
+            {
+                bantam::order_book_change c = feed.next();
+                updates.push_back(change_type{c.side, levels.to_price(c.price), levels.to_volume(c.volume)});
+            }
+            r.run("update", [&](size_t i)
+            {
+                const change_type& c = updates[i % updates.size()];
+                sink_value = c.side == bantam::order_book_side::bid ? book.update_bid(c.price, c.volume) : book.update_ask(c.price, c.volume);
+            });
+        }
+
+        // Orders taking about one level each, the book is restored after every batch
+        {
+            Book book(levels);
+            book.apply_snapshot(full);
+            std::vector<typename Book::volume_type> volumes;
+            for (size_t i = 0; i < 4096; ++i)
+                volumes.push_back(levels.to_volume(feed.volume(1.5)));
+            auto bid_limit = levels.to_price(feed.price(bantam::order_book_side::bid, options.depth));
+            auto ask_limit = levels.to_price(feed.price(bantam::order_book_side::ask, options.depth));
+            auto restore = [&]{reset_changes.clear(); book.apply_snapshot(full, reset_changes);};
+            r.run("buy_partial", [&](size_t i)
+            {
+                changes.clear();
+                book.buy_partial(bid_limit, volumes[i % volumes.size()], changes);
+            }, restore);
+            r.run("sell_partial", [&](size_t i)
+            {
+                changes.clear();
+                book.sell_partial(ask_limit, volumes[i % volumes.size()], changes);
+            }, restore);
+        }
+
+        // Copies of the whole book, and snapshots merged into it alternating between two
+        // states a few dozen updates apart
+        {
+            Book book(levels);
+            book.apply_snapshot(full);
+            r.run("snapshot", [&](size_t)
+            {sink_value = book.snapshot().size();});
+
+            bantam::order_book other;
+            other.apply_snapshot(full);
+            for (size_t i = 0; i < 32; ++i)
+            {
+                bantam::order_book_change c = feed.next();
+                other.update_level(c.side, c.price, c.volume);
+            }
+            const std::vector<bantam::order_book_change> moved = other.snapshot();
+            r.run("apply_snapshot", [&](size_t i)
+            {
+                changes.clear();
+                book.apply_snapshot(i & 1 ? moved : full, changes);
+                sink_value = changes.size();
+            });
+        }
+
+        // Data messages decoded and applied the way a client applies a book subscription
+        {
+            message_feed messages(options, std::min<size_t>(options.ops, 100000));
+            int decimals = price_decimals(options.tick_size);
+            const std::vector<std::string> json = messages.json(decimals);
+            const std::vector<std::vector<char>> binary = messages.binary(decimals);
+
+            Book book(levels);
+            bantam::basic_order_book_sink<Book> sink(book);
+            bantam::sequence_stats stats;
+            bantam::order_book_sequencer sequencer(stats);
+            auto find = [&](const char*, size_t) -> bantam::order_book_sink*
+            {return sequencer.route(&sink);};
+            bantam::order_book_decoder decoder;
+            r.run("decode_json", [&](size_t i)
+            {
+                const std::string& m = json[i % json.size()];
+                bantam::order_book_message message;
+                decoder.decode(m.c_str(), m.size(), find, message);
+                sink_value = sequencer.check(message);
+            });
+            bantam::binary_book_decoder binary_decoder;
+            r.run("decode_binary", [&](size_t i)
+            {
+                const std::vector<char>& m = binary[i % binary.size()];
+                bantam::order_book_message message;
+                binary_decoder.decode(m.data(), m.size(), find, message);
+                sink_value = sequencer.check(message);
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv) try
+{
+    bench_options options;
+
+    CLI::App app("Bantam order book and decoder benchmarks");
+    app.add_option("--book", options.book, "Order book type: map, pooled, flat, fixed or ladder", true);
+    app.add_option("--filter", options.filter, "Only run benchmarks whose name contains this");
+    app.add_option("--ops", options.ops, "Operations per benchmark", true);
+    app.add_option("--batch", options.batch, "Operations timed together", true);
+    app.add_option("--depth", options.depth, "Levels on each side of the book", true);
+    app.add_option("--remove-ratio", options.remove_ratio, "Share of updates that remove a level", true);
+    app.add_option("--prices", options.prices, "Price distribution of updates: near or uniform", true);
+    app.add_option("--levels-per-message", options.levels_per_message, "Levels of each update message", true);
+    app.add_option("--snapshot-every", options.snapshot_every, "Messages between snapshots, 0 for only the first", true);
+    app.add_option("--tick-size", options.tick_size, "Price tick size", true);
+    app.add_option("--seed", options.seed, "Random seed of the feeds", true);
+
+    try
+    {
+        app.parse(argc, argv);
+    }
+    catch(CLI::Error& e)
+    {
+        return app.exit(e);
+    }
+    if (options.tick_size <= 0 || options.remove_ratio < 0 || options.remove_ratio > 1
+            || (options.prices != "near" && options.prices != "uniform"))
+        throw std::invalid_argument("Invalid option value");
+    const std::vector<std::string> books = {"map", "pooled", "flat", "fixed", "ladder"};
+    if (std::find(books.begin(), books.end(), options.book) == books.end())
+        throw std::invalid_argument("Unknown order book type: " + options.book);
+
+    // Gives the tick calibration a stable baseline
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::printf("book %s, depth %zu, %s prices, %.0f%% removes, %zu levels per message, percentiles of ns/op per batch of %zu\n",
+                options.book.c_str(), options.depth, options.prices.c_str(), options.remove_ratio * 100,
+                options.levels_per_message, options.batch);
+    print_header();
+
+    bantam::fixed_levels fixed(options.tick_size, 1e-8);
+    if (options.book == "map")
+        run_book<bantam::order_book>(options, bantam::floating_levels());
+    else if (options.book == "pooled")
+        run_book<bantam::pooled_order_book>(options, bantam::floating_levels());
+    else if (options.book == "flat")
+        run_book<bantam::flat_order_book>(options, bantam::floating_levels());
+    else if (options.book == "fixed")
+        run_book<bantam::fixed_order_book>(options, fixed);
+    else run_book<bantam::ladder_order_book>(options, fixed);
+    return EXIT_SUCCESS;
+}
+catch(std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
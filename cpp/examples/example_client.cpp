@@ -1,4 +1,4 @@
-#include <bantam/client.h>
+#include <bantam/client_pool.h>
 #include <bantam/order_book.h>
 
 #include <CLI11.hpp>
@@ -12,14 +12,57 @@ void signal_handler(int signal)
     wait_signal.set_value(true);
 }
 
+void print_rounding(const bantam::order_book&)
+{}
+void print_rounding(const bantam::ladder_order_book& book)
+{
+    const auto& levels = book.get_levels();
+    if (levels.get_rounded_prices() || levels.get_rounded_volumes())
+        std::cout << "Warning: " << levels.get_rounded_prices() << " prices and " << levels.get_rounded_volumes()
+                  << " volumes were not multiples of the tick and lot sizes" << std::endl;
+}
+
+// Applies the queued updates and prints the book until Ctrl+C
+template <typename Book>
+void show_book(Book& book, bantam::order_book_queue& updates)
+{
+    std::cout << "Press Ctrl+C to stop" << std::endl;
+    auto stopped = wait_signal.get_future();
+    bantam::order_book_update update;
+    std::vector<typename Book::change_type> changes;
+    while (stopped.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+    {
+        changes.clear();
+        while (updates.try_pop(update))
+            bantam::apply(book, update, changes);
+        // Only redraw when a level actually changed
+        if (changes.empty())
+            continue;
+#ifdef WIN32
+        std::system("cls");
+#else
+        std::system("clear");
+#endif
+        book.print();
+        print_rounding(book);
+    }
+}
+
 int main(int argc, char** argv) try
 {
     std::string host = "127.0.0.1";
     std::string port = "9999";
+    // Without a tick size the book keeps prices as they arrive. With the tick size of the
+    // channel it is a ladder of 1024 ticks around the best price, a tick too small leaves
+    // most levels outside of it and one too large merges levels.
+    double tick_size = 0;
+    double lot_size = 1e-8;
 
     CLI::App app("Bantam network client example");
     app.add_option("host", host, "Server host address");
     app.add_option("port", port, "Server port");
+    app.add_option("--tick-size", tick_size, "Price tick size of the order book channel, shows it as a price ladder");
+    app.add_option("--lot-size", lot_size, "Volume lot size of the order book channel", true);
 
     try
     {
@@ -30,43 +73,11 @@ int main(int argc, char** argv) try
         return app.exit(e);
     }
 
-    boost::asio::io_context ioc;
-    bantam::pclient client = std::make_shared<bantam::client>(ioc, host, "/", port);
+    bantam::client_pool pool(1);
+    bantam::pclient client = pool.create(host, "/", port);
 
-    bantam::order_book book;
-    auto data_callback = [&](const rapidjson::Value& doc)
-    {
-        using namespace rapidjson;
-//        OStreamWrapper w(std::cout);
-//        Writer<OStreamWrapper> ww(w);
-//        doc.Accept(ww);
-//        std::cout << std::endl;
-
-        const auto& content = doc["data"].GetObject();
-        std::string type = content["type"].GetString();
-        if (type == "snapshot")
-            book.clear();
-        const auto& bids = content["bids"].GetArray();
-        for (const auto& v : bids)
-        {
-            double price = v[0].GetDouble();
-            double vol   = v[1].GetDouble();
-            book.update_bid(price, vol);
-        }
-        const auto& asks = content["asks"].GetArray();
-        for (const auto& v : asks)
-        {
-            double price = v[0].GetDouble();
-            double vol   = v[1].GetDouble();
-            book.update_ask(price, vol);
-        }
-#ifdef WIN32
-        std::system("cls");
-#else
-        std::system("clear");
-#endif
-        book.print();
-    };
+    // Updates are applied and printed by the main thread, so a slow terminal does not stall the socket
+    bantam::order_book_queue updates(1024, bantam::overflow_policy::coalesce);
     auto ready_callback = [&](){
         client->get_resource("channels", [&](const rapidjson::Value& doc)
         {
@@ -77,19 +88,25 @@ int main(int argc, char** argv) try
             }
             if (doc.Size() > 0)
             {
-                client->subscribe(doc[0].GetString(), data_callback);
-//                client->subscribe("binance/ETHBTC", data_callback);
+                client->subscribe_order_book(doc[0].GetString(), updates);
+//                client->subscribe_order_book("binance/ETHBTC", updates);
             }
         });
     };
 
     client->run(ready_callback);
-    std::thread t{[&](){ioc.run();}};
-    std::cout << "Press Ctrl+C to stop" << std::endl;
-    wait_signal.get_future().get();
-    client->stop();
-    ioc.stop();
-    t.join();
+    pool.run();
+    if (tick_size > 0)
+    {
+        bantam::ladder_order_book book{bantam::fixed_levels(tick_size, lot_size)};
+        show_book(book, updates);
+    }
+    else
+    {
+        bantam::order_book book;
+        show_book(book, updates);
+    }
+    pool.stop();
     return EXIT_SUCCESS;
 }
 catch(std::exception& e)
@@ -0,0 +1,184 @@
+#include <catch.hpp>
+
+#include <bantam/decimal_parser.h>
+
+#include <rapidjson/document.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace
+{
+    // rapidjson's default parsing of a lone number, which the decoder falls back to
+    // whenever the decimal parser declines one
+    bool reference(const std::string& text, double& value)
+    {
+        rapidjson::Document document;
+        document.Parse(("[" + text + "]").c_str());
+        if (document.HasParseError() || document.Size() != 1 || !document[0].IsNumber())
+            return false;
+        value = document[0].GetDouble();
+        return true;
+    }
+
+    uint64_t bits(double d)
+    {
+        uint64_t b;
+        std::memcpy(&b, &d, sizeof(b));
+        return b;
+    }
+
+    using parser = bool (*)(const char*&, const char*, double&);
+
+    // A number the parser takes must be exactly rapidjson's and end where the text ends.
+    // Returns whether the parser took it.
+    bool check(parser parse, const std::string& text, const std::string& after)
+    {
+        std::string buffer = text + after;
+        const char* p = buffer.data();
+        double value = 0;
+        bool taken = parse(p, buffer.data() + buffer.size(), value);
+        INFO("number " << text << " followed by '" << after << "'");
+        double expected = 0;
+        bool valid = reference(text, expected);
+        if (!taken)
+        {
+            REQUIRE(p == buffer.data());
+            return false;
+        }
+        REQUIRE(valid);
+        REQUIRE(p == buffer.data() + text.size());
+        REQUIRE(bits(value) == bits(expected));
+        return true;
+    }
+
+    // Checks the number against every parser the platform has, followed by a short tail
+    // that keeps the SSE parser on its scalar fallback and by one long enough for it to
+    // load 16 bytes. All must agree on taking it.
+    bool check_all(const std::string& text)
+    {
+        std::vector<parser> parsers{&bantam::detail::parse_decimal};
+#ifdef BANTAM_DECIMAL_SSE
+        if (bantam::detail::has_sse41())
+            parsers.push_back(&bantam::detail::parse_decimal_sse);
+#endif
+        bool taken = check(parsers.front(), text, "]");
+        for (parser parse : parsers)
+            for (const char* after : {"]", "],[0.5,1.25]]          "})
+                REQUIRE(check(parse, text, after) == taken);
+        return taken;
+    }
+}
+
+TEST_CASE("plain decimals match rapidjson", "[decimal_parser]")
+{
+    for (const char* text : {"0", "1", "-1", "0.5", "0.1", "0.3", "9999.99", "12345.678", "0.00000001",
+                             "-123.456", "100", "42.00000000", "3.14159265358979", "0.1234567890123"})
+        REQUIRE(check_all(text));
+}
+
+TEST_CASE("negative zero", "[decimal_parser]")
+{
+    for (const char* text : {"-0", "-0.0", "-0.00000000", "0.0"})
+        REQUIRE(check_all(text));
+}
+
+TEST_CASE("fast path limits", "[decimal_parser]")
+{
+    SECTION("integer digits")
+    {
+        REQUIRE(check_all("123456789012345678"));
+        REQUIRE(check_all("-123456789012345678"));
+        REQUIRE_FALSE(check_all("1234567890123456789"));
+        REQUIRE_FALSE(check_all("12345678901234567890123"));
+    }
+    SECTION("significand around 2^53")
+    {
+        REQUIRE(check_all("9007199254740991"));
+        REQUIRE(check_all("0.9007199254740991"));
+        REQUIRE(check_all("900719925474099.1"));
+        // The last digit still goes into the significand, as rapidjson does
+        REQUIRE(check_all("0.9007199254740993"));
+        REQUIRE_FALSE(check_all("0.90071992547409931"));
+    }
+    SECTION("more than 19 digits")
+    {
+        REQUIRE_FALSE(check_all("0.12345678901234567890123"));
+        REQUIRE_FALSE(check_all("1234567890.1234567890"));
+        REQUIRE_FALSE(check_all("-99999999999999999999"));
+    }
+    SECTION("fraction digits")
+    {
+        REQUIRE(check_all("0.0000000000000000000001"));
+        REQUIRE_FALSE(check_all("0.00000000000000000000001"));
+    }
+    SECTION("16 byte window of the SSE parser")
+    {
+        REQUIRE(check_all("123456789012345"));
+        REQUIRE(check_all("1234567.1234567"));
+        REQUIRE(check_all("-1234567.1234567"));
+        REQUIRE(check_all("1234567.12345678"));
+        REQUIRE(check_all("0.12345678901234"));
+        REQUIRE(check_all("12345678901234.5"));
+    }
+}
+
+TEST_CASE("exponents are left to rapidjson", "[decimal_parser]")
+{
+    for (const char* text : {"1e5", "1E5", "1.5e-3", "-2.5E+10", "0e0", "1e22", "1e-22", "1e308", "1e-324"})
+        REQUIRE_FALSE(check_all(text));
+}
+
+TEST_CASE("invalid numbers are declined", "[decimal_parser]")
+{
+    for (const char* text : {"1.", "-1.", "-", ".5", "-.5", "01", "00.5", "-01", "+1", "", "x", "1.x"})
+        REQUIRE_FALSE(check_all(text));
+}
+
+TEST_CASE("random prices and volumes match rapidjson", "[decimal_parser]")
+{
+    std::mt19937_64 random(1);
+    char text[64];
+    for (int decimals = 0; decimals <= 12; ++decimals)
+        for (int magnitude = 0; magnitude <= 10; ++magnitude)
+            for (int i = 0; i < 200; ++i)
+            {
+                double v = std::uniform_real_distribution<double>(0, std::pow(10.0, magnitude))(random);
+                if (i % 2)
+                    v = -v;
+                std::snprintf(text, sizeof(text), "%.*f", decimals, v);
+                bool taken = check_all(text);
+                // Up to 15 digits the significand is always below 2^53
+                if (magnitude + decimals <= 15)
+                    REQUIRE(taken);
+            }
+}
+
+TEST_CASE("level arrays match rapidjson", "[decimal_parser]")
+{
+    std::vector<std::pair<double, double>> pairs;
+    const std::string levels = "[[9999.99, 0.5],[10000.01,1.25] , [ 10000.5 ,-0],[0.00000001,123456789012.12345]]";
+    const char* close = bantam::parse_decimal_pairs(levels.data() + 1, levels.data() + levels.size(), pairs);
+    REQUIRE(close == levels.data() + levels.size() - 1);
+
+    rapidjson::Document document;
+    document.Parse(levels.c_str());
+    REQUIRE(document.Size() == pairs.size());
+    for (rapidjson::SizeType i = 0; i < document.Size(); ++i)
+    {
+        REQUIRE(bits(pairs[i].first) == bits(document[i][0].GetDouble()));
+        REQUIRE(bits(pairs[i].second) == bits(document[i][1].GetDouble()));
+    }
+
+    for (const char* text : {"[1,2]]", "[[1,2,3]]", "[[1e5,2]]", "[[1,2]", "[[1,2],]", "[[\"1\",2]]"})
+    {
+        std::string s = text;
+        INFO(s);
+        REQUIRE(bantam::parse_decimal_pairs(s.data() + 1, s.data() + s.size(), pairs) == nullptr);
+    }
+    std::string empty = "[ ]";
+    REQUIRE(bantam::parse_decimal_pairs(empty.data() + 1, empty.data() + empty.size(), pairs) == empty.data() + 2);
+    REQUIRE(pairs.empty());
+}
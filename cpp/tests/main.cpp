@@ -0,0 +1,5 @@
+#define CATCH_CONFIG_MAIN
+// The signal handlers of this Catch version need SIGSTKSZ to be a constant, which newer
+// glibc no longer guarantees
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
+#include <catch.hpp>
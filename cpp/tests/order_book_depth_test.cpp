@@ -0,0 +1,154 @@
+#include <catch.hpp>
+
+#include <bantam/order_book.h>
+
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+
+namespace
+{
+    // Prices on a 0.01 tick and volumes on a 0.001 lot, kept as whole ticks and lots so
+    // the brute force sums are exact
+    double price(int64_t ticks)
+    {return ticks / 100.0;}
+    double volume(int64_t lots)
+    {return lots / 1000.0;}
+
+    struct reference
+    {
+        std::map<int64_t, int64_t, std::greater<int64_t>> bids;
+        std::map<int64_t, int64_t> asks;
+
+        double median() const
+        {
+            if (bids.empty() && asks.empty())
+                return 0;
+            if (bids.empty())
+                return price(asks.begin()->first);
+            if (asks.empty())
+                return price(bids.begin()->first);
+            return (price(bids.begin()->first) + price(asks.begin()->first)) / 2;
+        }
+    };
+
+    template <typename Side>
+    int64_t total(const Side& side)
+    {
+        int64_t lots = 0;
+        for (const auto& level : side)
+            lots += level.second;
+        return lots;
+    }
+
+    // Walks the levels best first until lots are taken
+    template <typename Side>
+    double vwap(const Side& side, int64_t lots)
+    {
+        int64_t left = lots;
+        double notional = 0;
+        for (const auto& level : side)
+        {
+            int64_t take = std::min(left, level.second);
+            notional += price(level.first) * volume(take);
+            if (!(left -= take))
+                return notional / volume(lots);
+        }
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    template <typename Side>
+    int64_t reach(const Side& side, int64_t lots)
+    {
+        for (const auto& level : side)
+            if ((lots -= level.second) <= 0)
+                return level.first;
+        return 0;
+    }
+    template <typename Side, typename Within>
+    double depth(const Side& side, Within within)
+    {
+        int64_t lots = 0;
+        for (const auto& level : side)
+            if (within(price(level.first)))
+                lots += level.second;
+        return volume(lots);
+    }
+
+    Approx near(double value)
+    {return Approx(value).epsilon(1e-12);}
+
+    template <typename Book, typename Side>
+    void check_side(const Book& book, const Side& side, bantam::order_book_side s, bool exact)
+    {
+        const auto& levels = book.get_levels();
+        int64_t lots = total(side);
+        for (int64_t v = 1; v <= lots; ++v)
+        {
+            // A double volume that adds up to exactly a level boundary may land on either
+            // side of it, volumes are even so odd ones never do
+            if (!exact && v % 2 == 0)
+                continue;
+            auto amount = levels.to_volume(volume(v));
+            REQUIRE(levels.from_price(book.vwap_for_volume(s, amount)) == near(vwap(side, v)));
+            REQUIRE(levels.from_price(book.price_for_volume(s, amount)) == near(price(reach(side, v))));
+        }
+        REQUIRE(std::isnan(book.vwap_for_volume(s, levels.to_volume(volume(lots + 1)))));
+        using limits = std::numeric_limits<typename Book::price_type>;
+        auto none = s == bantam::order_book_side::bid ? limits::min() : limits::max();
+        REQUIRE(book.price_for_volume(s, levels.to_volume(volume(lots + 1))) == none);
+    }
+
+    template <typename Book>
+    void check(const Book& book, const reference& ref, bool exact)
+    {
+        const auto& levels = book.get_levels();
+        double median = ref.median();
+        REQUIRE(levels.from_price(book.get_median_price()) == near(median));
+        // Limits are never within a rounding error of a price at these widths
+        for (double bps : {7.3, 31.7, 1000.1})
+        {
+            auto within = book.depth_within(bps);
+            double range = median * bps / 10000;
+            REQUIRE(levels.from_volume(within.bids) == near(depth(ref.bids, [&](double p) {return p >= median - range;})));
+            REQUIRE(levels.from_volume(within.asks) == near(depth(ref.asks, [&](double p) {return p <= median + range;})));
+        }
+        check_side(book, ref.bids, bantam::order_book_side::bid, exact);
+        check_side(book, ref.asks, bantam::order_book_side::ask, exact);
+    }
+
+    template <typename Book>
+    void check_random(Book book, bool exact)
+    {
+        std::mt19937 random(20);
+        reference ref;
+        check(book, ref, exact);
+        for (int batch = 0; batch < 40; ++batch)
+        {
+            for (int i = 0; i < 25; ++i)
+            {
+                bool bid = random() % 2 == 0;
+                int64_t ticks = bid ? 9950 + random() % 50 : 10001 + random() % 50;
+                int64_t lots = random() % 3 ? 2 * (1 + random() % 20) : 0;
+                book.update_level(bid ? bantam::order_book_side::bid : bantam::order_book_side::ask, price(ticks), volume(lots));
+                if (bid)
+                    lots ? ref.bids[ticks] = lots : ref.bids.erase(ticks);
+                else lots ? ref.asks[ticks] = lots : ref.asks.erase(ticks);
+            }
+            check(book, ref, exact);
+        }
+    }
+}
+
+TEST_CASE("depth queries match a brute force walk of the levels", "[order_book]")
+{
+    bantam::fixed_levels levels(0.01, 0.001);
+
+    SECTION("floating levels")
+    {check_random(bantam::order_book(), false);}
+    SECTION("flat storage with fixed levels")
+    {check_random(bantam::fixed_order_book(levels), true);}
+    SECTION("ladder storage with fixed levels")
+    {check_random(bantam::ladder_order_book(levels), true);}
+}
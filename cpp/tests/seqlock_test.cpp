@@ -0,0 +1,79 @@
+#include <catch.hpp>
+
+#include <bantam/seqlock.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // Fields derived from one another, a torn copy breaks the relation
+    struct quote
+    {
+        uint64_t a = 0;
+        uint64_t b = ~uint64_t(0);
+        double c = 0;
+        uint32_t d = 0;
+    };
+
+    quote make_quote(uint64_t i)
+    {
+        quote q;
+        q.a = i;
+        q.b = ~i;
+        q.c = static_cast<double>(i) * 0.5;
+        q.d = static_cast<uint32_t>(i * 7);
+        return q;
+    }
+
+    bool consistent(const quote& q)
+    {
+        return q.b == ~q.a && q.c == static_cast<double>(q.a) * 0.5 && q.d == static_cast<uint32_t>(q.a * 7);
+    }
+}
+
+TEST_CASE("seqlock returns what was stored", "[seqlock]")
+{
+    bantam::seqlock<quote> s;
+    REQUIRE(s.version() == 1);
+    REQUIRE(consistent(s.load()));
+    s.store(make_quote(42));
+    REQUIRE(s.version() == 2);
+    REQUIRE(s.load().a == 42);
+    REQUIRE(consistent(s.load()));
+}
+
+TEST_CASE("seqlock readers never see a torn value", "[seqlock]")
+{
+    const uint64_t count = 1000000;
+    bantam::seqlock<quote> s;
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> torn{0}, backwards{0}, reads{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i)
+        readers.emplace_back([&]
+        {
+            uint64_t last = 0;
+            while (!done)
+            {
+                quote q = s.load();
+                if (!consistent(q))
+                    ++torn;
+                if (q.a < last)
+                    ++backwards;
+                last = q.a;
+                ++reads;
+            }
+        });
+    for (uint64_t i = 1; i <= count; ++i)
+        s.store(make_quote(i));
+    done = true;
+    for (auto& t : readers)
+        t.join();
+    REQUIRE(reads > 0);
+    REQUIRE(torn == 0);
+    REQUIRE(backwards == 0);
+    REQUIRE(s.load().a == count);
+    REQUIRE(s.version() == count + 1);
+}
@@ -0,0 +1,270 @@
+#include <catch.hpp>
+
+#include <bantam/order_book.h>
+#include <bantam/order_book_queue.h>
+#include <bantam/spsc_ring.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using ring = bantam::spsc_ring<uint64_t>;
+
+    void push(ring& r, uint64_t value)
+    {
+        r.prepare() = value;
+        r.commit();
+    }
+
+    std::vector<uint64_t> drain(ring& r)
+    {
+        std::vector<uint64_t> out;
+        uint64_t value;
+        while (r.try_pop(value))
+            out.push_back(value);
+        return out;
+    }
+
+    // Coalesces by adding up, so a consumer can check that nothing was lost
+    struct total
+    {
+        uint64_t sum = 0;
+        uint64_t last = 0;
+    };
+    void coalesce(total& into, total& from)
+    {
+        into.sum += from.sum;
+        into.last = from.last;
+    }
+
+    bantam::order_book_update update(uint64_t sequence, bool snapshot, double price, double volume)
+    {
+        bantam::order_book_update u;
+        u.message.sequence = sequence;
+        u.message.timestamp = static_cast<int64_t>(1000 + sequence);
+        u.message.snapshot = snapshot;
+        u.message.levels = 1;
+        u.changes.push_back(bantam::order_book_change{bantam::order_book_side::bid, price, volume});
+        return u;
+    }
+
+    bool same(const std::vector<bantam::order_book_change>& a, const std::vector<bantam::order_book_change>& b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const bantam::order_book_change& x, const bantam::order_book_change& y)
+        {return x.side == y.side && x.price == y.price && x.volume == y.volume;});
+    }
+}
+
+TEST_CASE("spsc_ring is a FIFO of its rounded capacity", "[spsc_ring]")
+{
+    ring r(5);
+    REQUIRE(r.capacity() == 8);
+    uint64_t value;
+    REQUIRE_FALSE(r.try_pop(value));
+    for (uint64_t i = 0; i < 8; ++i)
+        push(r, i);
+    REQUIRE(r.size() == 8);
+    REQUIRE(drain(r) == std::vector<uint64_t>({0, 1, 2, 3, 4, 5, 6, 7}));
+    // Positions keep going round the slots
+    for (uint64_t lap = 0; lap < 100; ++lap)
+    {
+        push(r, lap);
+        push(r, lap + 1);
+        REQUIRE(drain(r) == std::vector<uint64_t>({lap, lap + 1}));
+    }
+    REQUIRE(r.dropped() == 0);
+    REQUIRE(r.coalesced() == 0);
+}
+
+TEST_CASE("drop_oldest discards the oldest items of a full ring", "[spsc_ring]")
+{
+    ring r(4, bantam::overflow_policy::drop_oldest);
+    for (uint64_t i = 0; i < 10; ++i)
+        push(r, i);
+    REQUIRE(r.dropped() == 6);
+    REQUIRE(drain(r) == std::vector<uint64_t>({6, 7, 8, 9}));
+}
+
+TEST_CASE("coalesce merges into the newest item of a full ring", "[spsc_ring]")
+{
+    SECTION("the default keeps the newest item")
+    {
+        ring r(4, bantam::overflow_policy::coalesce);
+        for (uint64_t i = 0; i < 10; ++i)
+            push(r, i);
+        REQUIRE(r.coalesced() == 6);
+        REQUIRE(drain(r) == std::vector<uint64_t>({0, 1, 2, 9}));
+    }
+    SECTION("room made by the consumer after prepare() is used")
+    {
+        ring r(2, bantam::overflow_policy::coalesce);
+        push(r, 1);
+        push(r, 2);
+        r.prepare() = 3;
+        uint64_t value;
+        REQUIRE(r.try_pop(value));
+        REQUIRE(value == 1);
+        r.commit();
+        REQUIRE(r.coalesced() == 0);
+        REQUIRE(drain(r) == std::vector<uint64_t>({2, 3}));
+    }
+    SECTION("order book updates carry the latest message fields")
+    {
+        bantam::order_book_queue q(2, bantam::overflow_policy::coalesce);
+        auto add = [&](bantam::order_book_update u) {q.prepare() = u; q.commit();};
+        add(update(1, true, 100, 1));
+        add(update(2, false, 101, 2));
+        add(update(3, false, 102, 3));
+        add(update(4, false, 101, 0));
+        REQUIRE(q.coalesced() == 2);
+
+        bantam::order_book_update u;
+        REQUIRE(q.try_pop(u));
+        REQUIRE(u.message.sequence == 1);
+        REQUIRE(q.try_pop(u));
+        REQUIRE(u.message.sequence == 4);
+        REQUIRE(u.message.timestamp == 1004);
+        REQUIRE(u.message.levels == 3);
+        REQUIRE(u.changes.size() == 3);
+
+        // A snapshot replaces what it is merged into
+        add(update(5, false, 103, 1));
+        add(update(6, false, 104, 1));
+        add(update(7, true, 105, 1));
+        REQUIRE(q.try_pop(u));
+        REQUIRE(u.message.sequence == 5);
+        REQUIRE(q.try_pop(u));
+        REQUIRE(u.message.sequence == 7);
+        REQUIRE(u.message.snapshot);
+        REQUIRE(u.changes.size() == 1);
+    }
+    SECTION("merged updates apply like the separate ones")
+    {
+        bantam::order_book separate, merged;
+        bantam::order_book_queue q(2, bantam::overflow_policy::coalesce);
+        std::vector<bantam::order_book_update> updates{
+            update(1, true, 100, 1), update(2, false, 101, 2), update(3, false, 100, 0), update(4, false, 99, 5), update(5, false, 101, 3)};
+        for (auto u : updates)
+        {
+            bantam::apply(separate, u);
+            q.prepare() = u;
+            q.commit();
+        }
+        bantam::order_book_update u;
+        while (q.try_pop(u))
+            bantam::apply(merged, u);
+        REQUIRE(same(merged.snapshot(), separate.snapshot()));
+    }
+}
+
+TEST_CASE("block waits for the consumer", "[spsc_ring]")
+{
+    ring r(2, bantam::overflow_policy::block);
+    push(r, 0);
+    push(r, 1);
+    std::atomic<bool> pushed{false};
+    std::thread producer([&]
+    {
+        push(r, 2);
+        pushed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE_FALSE(pushed);
+    uint64_t value;
+    REQUIRE(r.try_pop(value));
+    producer.join();
+    REQUIRE(pushed);
+    REQUIRE(drain(r) == std::vector<uint64_t>({1, 2}));
+}
+
+TEST_CASE("concurrent producer and consumer", "[spsc_ring]")
+{
+    const uint64_t count = 200000;
+
+    SECTION("block delivers everything in order")
+    {
+        ring r(64, bantam::overflow_policy::block);
+        std::thread producer([&]
+        {
+            for (uint64_t i = 1; i <= count; ++i)
+                push(r, i);
+        });
+        uint64_t expected = 1, value;
+        bool in_order = true;
+        while (expected <= count)
+        {
+            if (r.try_pop(value))
+                in_order = in_order && value == expected++;
+            else std::this_thread::yield();
+        }
+        producer.join();
+        REQUIRE(in_order);
+    }
+    SECTION("drop_oldest delivers a subsequence ending with the last item")
+    {
+        ring r(16, bantam::overflow_policy::drop_oldest);
+        std::atomic<bool> done{false};
+        std::thread producer([&]
+        {
+            for (uint64_t i = 1; i <= count; ++i)
+                push(r, i);
+            done = true;
+        });
+        uint64_t last = 0, received = 0, value;
+        bool increasing = true;
+        for (;;)
+        {
+            bool finished = done;
+            while (r.try_pop(value))
+            {
+                increasing = increasing && value > last;
+                last = value;
+                ++received;
+            }
+            if (finished)
+                break;
+        }
+        producer.join();
+        REQUIRE(increasing);
+        REQUIRE(last == count);
+        REQUIRE(received + r.dropped() == count);
+    }
+    SECTION("coalesce loses nothing")
+    {
+        bantam::spsc_ring<total> r(16, bantam::overflow_policy::coalesce);
+        std::atomic<bool> done{false};
+        std::thread producer([&]
+        {
+            for (uint64_t i = 1; i <= count; ++i)
+            {
+                total& t = r.prepare();
+                t.sum = i;
+                t.last = i;
+                r.commit();
+            }
+            done = true;
+        });
+        uint64_t sum = 0, last = 0;
+        bool increasing = true;
+        total t;
+        for (;;)
+        {
+            bool finished = done;
+            while (r.try_pop(t))
+            {
+                increasing = increasing && t.last > last;
+                last = t.last;
+                sum += t.sum;
+            }
+            if (finished)
+                break;
+        }
+        producer.join();
+        REQUIRE(increasing);
+        REQUIRE(last == count);
+        REQUIRE(sum == count * (count + 1) / 2);
+    }
+}